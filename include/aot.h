@@ -0,0 +1,52 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Compiles the script at 'path' and every module it imports, and writes them
+// to 'out' as one C translation unit with a main(). Returns false after
+// reporting an error.
+bool emitC(const char* path, const char* source, FILE* out);
+
+// Runtime support for the generated code, which links against the rest of
+// the VM in place of src/main.c.
+
+extern ValueArray aotConstants;  // Strings and functions the code loads.
+extern int* aotGlobalSlots;      // Generated global slot -> vm.globalValues.
+extern Table aotModules;         // Module path -> its top-level function.
+
+// Marks the objects above and the ones main() has created so far.
+void markAotRoots();
+
+ObjModule* aotModule(const char* path);
+ObjFunction* aotFunction(ObjModule* module, const char* name, int arity,
+                         AotFn body, const LineStart* lines, int lineCount,
+                         int count);
+void aotConstant(Value value);
+void aotResolveGlobals(const char* const* names, int count);
+void aotRun(ObjFunction* script);
+
+Value aotCall(Value* callee, int argCount);
+bool aotTailCall(Value* slots, Value* callee, int argCount);
+Value aotAdd(Value a, Value b);
+Value aotGetSubscript(Value list, Value index);
+Value aotSetSubscript(Value list, Value index, Value value);
+Value aotImport(Value* name);
+void aotExport(ObjString* name, Value value);
+
+// Reports a runtime error at the current frame's ip and exits.
+void aotError(const char* format, ...);
+
+static inline bool aotIsFalsey(Value value) {
+  return IS_NIL(value) ||
+         (IS_BOOL(value) && !AS_BOOL(value)) ||
+         (IS_NUMBER(value) && AS_NUMBER(value) == 0);
+}
+
+#endif
@@ -16,6 +16,9 @@ typedef enum {
     OP_GET_GLOBAL,
     OP_DEFINE_GLOBAL,
     OP_SET_GLOBAL,
+    OP_GET_GLOBAL_SLOT,
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_EXPORT_VAR,
@@ -34,6 +37,7 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,  // A call whose result the caller returns; reuses its frame.
     OP_NEW_LIST,
     OP_LIST_APPEND,
     OP_GET_SUBSCRIPT,
@@ -41,14 +45,98 @@ typedef enum {
     OP_RETURN,
     OP_IMPORT,
     OP_EXPORT,
+
+    // Quickened forms. The compiler never emits these: the VM rewrites a
+    // generic instruction in place once it has seen the operand types, and
+    // rewrites it back if a later execution sees different types. They pay
+    // off where code stays in the interpreter, such as builds without the
+    // JIT; the JIT compiles them like the generic forms.
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_GET_SUBSCRIPT_LIST_NUM,
+    OP_SET_SUBSCRIPT_LIST_NUM,
+
+    // Superinstructions. The compiler fuses these from runs of the generic
+    // instructions after a function is compiled; each takes the operands of
+    // the instructions it replaces, in order.
+    OP_LESS_LOCALS_JUMP,         // GET_LOCAL GET_LOCAL LESS JUMP_IF_FALSE POP
+    OP_LESS_LOCAL_CONSTANT_JUMP, // GET_LOCAL CONSTANT LESS JUMP_IF_FALSE POP
+    OP_ADD_LOCALS,               // GET_LOCAL GET_LOCAL ADD
+    OP_ADD_LOCAL_CONSTANT,       // GET_LOCAL CONSTANT ADD
+    OP_SUBTRACT_LOCAL_CONSTANT,  // GET_LOCAL CONSTANT SUBTRACT
+    OP_NOT_EQUAL,                // EQUAL NOT
+    OP_CONSTANT_CALL,            // CONSTANT CALL
+    OP_SET_LOCAL_POP,            // SET_LOCAL POP
+    OP_JUMP_IF_FALSE_OR_POP,     // JUMP_IF_FALSE POP
 } OpCode;
 
+// Opcodes for the register backend (--backend=register). Registers are the
+// slots of the current call frame: locals keep the slots the compiler gave
+// them and temporaries live above them. Operands are one byte each: A is the
+// destination register, B and C source registers, K a constant index, S a
+// two-byte global slot and J a two-byte jump offset.
+typedef enum {
+    ROP_MOVE,                 // A B      R[A] = R[B]
+    ROP_LOADK,                // A K      R[A] = K
+    ROP_LOADNIL,              // A        R[A] = nil
+    ROP_LOADTRUE,             // A        R[A] = true
+    ROP_LOADFALSE,            // A        R[A] = false
+    ROP_GET_GLOBAL,           // A S      R[A] = globals[S]
+    ROP_SET_GLOBAL,           // S B      globals[S] = R[B]
+    ROP_DEFINE_GLOBAL,        // S B      globals[S] = R[B], defining it
+    ROP_ADD,                  // A B C    R[A] = R[B] + R[C]
+    ROP_ADDK,                 // A B K    R[A] = R[B] + K
+    ROP_SUBTRACT,             // A B C
+    ROP_SUBTRACTK,            // A B K
+    ROP_MULTIPLY,             // A B C
+    ROP_MULTIPLYK,            // A B K
+    ROP_DIVIDE,               // A B C
+    ROP_DIVIDEK,              // A B K
+    ROP_MODULO,               // A B C
+    ROP_MODULOK,              // A B K
+    ROP_EQUAL,                // A B C    R[A] = R[B] == R[C]
+    ROP_EQUALK,               // A B K
+    ROP_LESS,                 // A B C    R[A] = R[B] < R[C]
+    ROP_LESSK,                // A B K
+    ROP_GREATER,              // A B C    R[A] = R[B] > R[C]
+    ROP_GREATERK,             // A B K
+    ROP_NOT,                  // A B      R[A] = !R[B]
+    ROP_NEGATE,               // A B      R[A] = -R[B]
+    ROP_JUMP,                 // J
+    ROP_JUMP_IF_FALSE,        // A J      if R[A] is falsey, jump
+    ROP_JUMP_IF_NOT_LESS,     // B C J    unless R[B] < R[C], jump
+    ROP_JUMP_IF_NOT_LESSK,    // B K J
+    ROP_LOOP,                 // J        jump backwards
+    ROP_CALL,                 // A N      R[A] = R[A](R[A+1], ..., R[A+N])
+    ROP_TAIL_CALL,            // A N      ROP_CALL reusing the current frame
+    ROP_RETURN,               // A        return R[A]
+    ROP_NEW_LIST,             // A        R[A] = []
+    ROP_LIST_APPEND,          // A B      append R[B] to the list in R[A]
+    ROP_GET_SUBSCRIPT,        // A B C    R[A] = R[B][R[C]]
+    ROP_SET_SUBSCRIPT,        // A B C D  R[B][R[C]] = R[D]; R[A] = R[D]
+    ROP_IMPORT,               // A        R[A] = the module named by R[A]
+    ROP_EXPORT,               // A K      export R[A] under the name K
+} RegOpCode;
+
+// One run of the line table: the bytecode from 'offset' up to the next
+// run's offset was compiled from 'line'.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 // A chunk of bytecode.
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
 } Chunk;
 
@@ -56,5 +144,19 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+// Returns the source line of the byte at 'offset'. Only error reporting and
+// the disassembler need lines, so they are looked up rather than stored per
+// byte.
+int getLine(Chunk* chunk, int offset);
+// Replaces the code and line table of 'chunk' with those of 'from', which a
+// pass has rewritten it into. The constants of 'chunk' stay.
+void replaceCode(Chunk* chunk, Chunk* from);
+
+// Helpers for passes that walk compiled stack bytecode.
+int operandBytes(uint8_t opcode);
+int stackEffect(Chunk* chunk, int offset);
+bool isJump(uint8_t opcode);
+// Returns the offset that the jump instruction at 'offset' lands on.
+int jumpTarget(Chunk* chunk, int offset);
 
 #endif
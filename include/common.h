@@ -7,7 +7,50 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Use direct-threaded dispatch (computed goto) in the interpreter loop when the
+// compiler supports it. Define FLS_NO_COMPUTED_GOTO to build the portable
+// switch-based loop instead.
+#if defined(__GNUC__) && !defined(FLS_NO_COMPUTED_GOTO)
+#define FLS_COMPUTED_GOTO
+#endif
+
+// Represent values as NaN-boxed 64-bit words instead of a tagged union,
+// halving the size of every stack slot, list element and table entry.
+// Define FLS_NO_NAN_BOXING to build with the tagged union instead.
+#ifndef FLS_NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// Fuse common instruction sequences into superinstructions after compiling
+// each function. Define FLS_NO_SUPERINSTRUCTIONS to run the bytecode exactly
+// as the compiler emitted it, e.g. when profiling for new fusion candidates.
+#ifndef FLS_NO_SUPERINSTRUCTIONS
+#define FLS_SUPERINSTRUCTIONS
+#endif
+
+// Probe hash tables sixteen slots at a time with SSE2 where the target has
+// it. Define FLS_NO_SIMD to build the portable scalar probe instead.
+#if defined(__SSE2__) && !defined(FLS_NO_SIMD)
+#define FLS_SSE2
+#endif
+
+// Count executed opcode sequences and print the hottest ones at exit.
+// #define DEBUG_PROFILE_OPCODES
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
 
+// Collect garbage on every allocation that grows the heap, so an object a
+// native forgot to push is freed straight away instead of once in a while.
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// Compile hot functions to x86-64 machine code. Needs NaN boxing and x86-64
+// Linux, and stays off while tracing or profiling, which have to see every
+// instruction. Define FLS_NO_JIT to always interpret.
+#if defined(NAN_BOXING) && defined(__x86_64__) && defined(__linux__) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(DEBUG_PROFILE_OPCODES) && \
+    !defined(FLS_NO_JIT)
+#define FLS_JIT
+#endif
+
 #endif
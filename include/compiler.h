@@ -8,4 +8,25 @@
 // Compiles source code and returns the top-level function, or NULL on error.
 ObjFunction* compile(const char* source, ObjModule* module);
 
+// Marks the functions being compiled so a collection mid-compile keeps them.
+void markCompilerRoots();
+
+// Whether a compile() is in progress.
+bool isCompiling();
+
+// Reports a runtime error, such as running out of memory, at the source
+// being compiled.
+void compilingError(const char* message);
+
+// Forgets the compilers of a compile() that an error unwound out of, and
+// frees their scratch space.
+void abandonCompilation();
+
+// Translates a compiled function's stack bytecode into register code in place.
+// Returns false if the function needs more registers than a frame can hold.
+bool compileRegisters(ObjFunction* function);
+
+// Frees the scratch space of a compileRegisters() that an error unwound out of.
+void abandonRegisterCompilation();
+
 #endif
@@ -11,4 +11,21 @@ void disassembleChunk(Chunk* chunk, const char* name);
 // Returns the offset of the next instruction.
 int disassembleInstruction(Chunk* chunk, int offset);
 
+// Disassembles a function compiled by the register backend.
+void disassembleRegisterChunk(Chunk* chunk, const char* name);
+
+// Disassembles a single register instruction, returning the next offset.
+int disassembleRegisterInstruction(Chunk* chunk, int offset);
+
+// Returns the printable name of an opcode, e.g. "OP_ADD".
+const char* opcodeName(uint8_t opcode);
+
+#ifdef DEBUG_PROFILE_OPCODES
+// Records that the VM is about to execute the given opcode.
+void profileOpcode(uint8_t opcode);
+
+// Prints the most frequently executed opcode sequences to stderr.
+void printOpcodeProfile();
+#endif
+
 #endif // FLS_DEBUG_H
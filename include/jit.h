@@ -0,0 +1,48 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+
+#ifdef FLS_JIT
+
+#include "object.h"
+#include "vm.h"
+
+// Calls plus loop iterations an interpreted function runs before it is
+// compiled to native code.
+#define JIT_THRESHOLD 1000
+
+// Native code for one function. It can be entered at any instruction
+// boundary, so a frame moves between the interpreter and native code at
+// calls, returns and loop back-edges.
+typedef struct JitCode {
+  uint8_t* code;      // Executable mapping, entered at offset 0.
+  size_t size;        // Bytes mapped.
+  uint8_t* start;     // Native code of the first instruction.
+  uint32_t* entries;  // Native offset of the instruction at each bytecode offset.
+  int entryCount;
+} JitCode;
+
+// Compiles the function's bytecode. Returns false if no executable memory
+// could be mapped, in which case the function stays interpreted.
+bool jitCompile(ObjFunction* function);
+
+// Runs the frame's function in native code from frame->ip until it reaches
+// an instruction the native code leaves to the interpreter. Native calls and
+// returns can change vm.frameCount on the way; the ip of whatever frame is
+// on top afterwards points at the instruction to interpret next.
+void jitExecute(CallFrame* frame);
+
+void freeJitCode(ObjFunction* function);
+
+// Counts a call or loop iteration of an interpreted function and compiles
+// the function once it gets hot.
+static inline void jitCountHotness(ObjFunction* function) {
+  if (function->jit == NULL && ++function->hotness == JIT_THRESHOLD) {
+    jitCompile(function);
+  }
+}
+
+#endif
+
+#endif
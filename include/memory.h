@@ -19,8 +19,45 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Objects never grow, so they come from the slabs.
+#define ALLOCATE_SLAB(type, count) \
+    (type*)slabAllocate(sizeof(type) * (count))
+
+#define FREE_SLAB(type, pointer, count) \
+    slabFree(pointer, sizeof(type) * (count))
+
 // Main memory management function for resizing dynamic arrays.
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+// Allocates a block that is never resized from the free list of its size
+// class. Blocks larger than the biggest class come from malloc().
+void* slabAllocate(size_t size);
+// Like slabAllocate(), but never starts a collection, for code that holds
+// object pointers the collector cannot see. The next allocation that can
+// collect catches up.
+void* slabAllocateNoCollect(size_t size);
+// Returns a block from slabAllocate(), given the size it was allocated with.
+void slabFree(void* pointer, size_t size);
+// Marks an object reachable, so the next sweep keeps it.
+void markObject(Obj* object);
+// Marks the object a value refers to, if any.
+void markValue(Value value);
+// Records an old object that may refer to young ones, for the next minor
+// collection to trace.
+void rememberObject(Obj* object);
+// Frees every object not reachable from the VM's roots.
+void collectGarbage();
+// Frees the young objects not reachable from the roots or from remembered
+// old objects, and promotes the rest.
+void collectNursery();
+
+// Write barrier, called after storing 'value' into 'object'. Minor
+// collections do not trace old objects, so an old object that now refers
+// to a young one has to be remembered.
+static inline void writeBarrier(Obj* object, Value value) {
+    if (object->isMarked && IS_OBJ(value) && !AS_OBJ(value)->isMarked) {
+        rememberObject(object);
+    }
+}
 // Frees all allocated objects.
 void freeObjects();
 
@@ -1,6 +1,8 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <string.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
@@ -13,7 +15,7 @@
 #define IS_LIST(value)         isObjType(value, OBJ_LIST)
 #define IS_MODULE(value)       isObjType(value, OBJ_MODULE)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
-#define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_STRING(value)       isString(value)
 #define IS_UPVALUE(value)      isObjType(value, OBJ_UPVALUE)
 #define IS_MAP(value)         isObjType(value, OBJ_MAP)
 
@@ -22,8 +24,8 @@
 #define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
 #define AS_MODULE(value)       ((ObjModule*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
-#define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_STRING(value)       asString(value)
+#define AS_CSTRING(value)      (asString(value)->chars)
 #define AS_UPVALUE(value)      ((ObjUpvalue*)AS_OBJ(value))
 #define AS_MAP(value)         ((ObjMap*)AS_OBJ(value))
 
@@ -35,18 +37,29 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE,
-  OBJ_MAP
+  OBJ_MAP,
+  OBJ_ROPE
 } ObjType;
 
 struct Obj {
   ObjType type;
+  bool isMarked;      // Outside a collection, set exactly on old objects.
+  bool isRemembered;  // In vm.remembered.
   struct Obj* next;
 };
 
+// The C body `fls --emit-c` generates for a function. The callee and its
+// arguments are in slots[0..arity].
+typedef Value (*AotFn)(Value* slots);
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int registerCount;  // Frame slots used by register code.
+  uint32_t hotness;   // Calls and loop iterations while interpreted.
+  struct JitCode* jit;  // Native code, or NULL while interpreted.
+  AotFn aot;          // Generated C body, in programs built with --emit-c.
   Chunk chunk;
   ObjString* name;
   struct ObjModule* module;
@@ -59,13 +72,56 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
+// The characters follow the header in the same block, so a string is one
+// allocation and short ones share the header's cache line.
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
-  uint32_t hash;
+  uint32_t hash;  // 0 until first needed, for strings that are not interned.
+  char chars[];   // NUL-terminated.
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Strings up to this long are interned, so two of them are equal exactly
+// when they are the same object. Longer ones, such as whole files read in,
+// are neither hashed nor interned unless they are used as a key, and
+// compare by their characters.
+#define STRING_INTERN_MAX 256
+
+static inline bool isInterned(ObjString* string) {
+  return string->length <= STRING_INTERN_MAX;
+}
+
+uint32_t hashString(const char* key, int length);
+
+static inline uint32_t stringHash(ObjString* string) {
+  if (string->hash == 0) {
+    string->hash = hashString(string->chars, string->length);
+  }
+  return string->hash;
+}
+
+static inline bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  if (isInterned(a)) return false;
+  return a->length == b->length &&
+         memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+// A string concatenated from two others, whose characters are only copied
+// out when something needs them. Script code sees ropes as strings:
+// AS_STRING() flattens them. Concatenation only makes a rope when the
+// result is too long to be interned, so appending to a string in a loop
+// takes linear time.
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;        // ObjString or ObjRope; NULL once flattened.
+  Obj* right;
+  ObjString* flat;  // The characters, once flattened.
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
@@ -80,11 +136,24 @@ typedef struct {
   int upvalueCount;
 } ObjClosure;
 
+#define LIST_INLINE_CAPACITY 4
+
+// Short lists keep their items in the object itself: items.values points
+// at inlineItems until the list grows past LIST_INLINE_CAPACITY.
+//
+// Lists double as deques. The storage holds 'head' free slots in front of
+// items.values, then items.capacity slots, so shifting from or unshifting
+// onto the front just moves items.values, and indexing stays a plain load.
 typedef struct {
   Obj obj;
-  ValueArray* items;
+  ValueArray items;
+  int head;
+  Value inlineItems[LIST_INLINE_CAPACITY];
 } ObjList;
 
+// The allocation behind a list's items.
+#define LIST_STORAGE(list) ((list)->items.values - (list)->head)
+
 typedef struct {
   Obj obj;
   Table table;
@@ -100,14 +169,53 @@ static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Copies a rope's characters into a string, once. Never collects, so
+// AS_STRING() is safe wherever a raw object pointer is live.
+ObjString* flattenRope(ObjRope* rope);
+
+static inline bool isString(Value value) {
+  return isObjType(value, OBJ_STRING) || isObjType(value, OBJ_ROPE);
+}
+
+static inline ObjString* asString(Value value) {
+  Obj* object = AS_OBJ(value);
+  if (object->type == OBJ_STRING) return (ObjString*)object;
+  return flattenRope((ObjRope*)object);
+}
+
+// The length of a string or rope, without flattening.
+static inline int stringLength(Obj* string) {
+  return string->type == OBJ_STRING ? ((ObjString*)string)->length
+                                    : ((ObjRope*)string)->length;
+}
+
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjList* newList();
+// Appends to a list, which the caller keeps reachable, along with 'value'.
+void listAppend(ObjList* list, Value value);
+// Inserts at the front of a list, which the caller keeps reachable, along
+// with 'value'.
+void listPrepend(ObjList* list, Value value);
+// Removes and returns the first item of a non-empty list.
+Value listShift(ObjList* list);
+// Empties a list and returns its items to inline storage.
+void listClear(ObjList* list);
 ObjMap* newMap();
 ObjModule* newModule();
 ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
+// Allocates a string of 'length' characters that the caller fills in and
+// then hands to takeString(), without allocating anything in between.
+ObjString* reserveString(int length);
+// Links in a string from reserveString(), interning it if it is short
+// enough. Returns the interned copy instead, and frees 'string', if the
+// table already has one.
+ObjString* takeString(ObjString* string);
+// Frees a string from reserveString() that is not going to be taken after all.
+void discardString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
+// Concatenates two strings or ropes, which the caller keeps reachable.
+Obj* concatenateStrings(Obj* a, Obj* b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
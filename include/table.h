@@ -4,17 +4,29 @@
 #include "common.h"
 #include "value.h"
 
-// An entry in the hash table.
+// An entry in the hash table. Keys are strings, or for maps also nil,
+// bools and numbers.
 typedef struct {
-    ObjString* key;
+    Value key;
     Value value;
 } Entry;
 
-// The hash table itself.
+// The hash table itself: a dense array of entries in insertion order, found
+// through a Swiss table index. Each index slot has a control byte, kept in a
+// separate array, that says whether the slot is empty, deleted, or full; a
+// full slot's byte holds seven bits of its key's hash, and its index entry
+// the position of its entry. Lookups compare a whole group of control bytes
+// at once and only look at the entries whose bytes match. Walking the
+// entries array visits the keys in the order they were first set.
 typedef struct {
-    int count;
-    int capacity;
-    Entry* entries;
+    int count;          // Live entries.
+    int capacity;       // Index slots: zero or a power of two no smaller
+                        // than a group.
+    int8_t* control;
+    int32_t* index;
+    int entryCount;     // Entries appended, live or deleted.
+    int entryCapacity;
+    Entry* entries;     // A deleted entry has an UNDEFINED_VAL key.
 } Table;
 
 // Initializes a hash table.
@@ -30,8 +42,30 @@ bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 
 // Deletes a key from the table. Returns true if the key was found and deleted.
+// Shrinks the table once few enough entries are left.
 bool tableDelete(Table* table, ObjString* key);
 
+// Deletes a key like tableDelete(), but never resizes the table. The
+// collector uses it, since resizing allocates.
+bool tableDeleteNoShrink(Table* table, ObjString* key);
+
+// Returns 'key' in the form tables store it, with ropes flattened and -0
+// made 0, or UNDEFINED_VAL if it cannot be a key. Keys are nil, bools,
+// strings and numbers other than NaN.
+Value tableKey(Value key);
+
+// The same operations for any key tableKey() has returned. The functions
+// above are shorthands for string keys.
+bool tableGetValue(Table* table, Value key, Value* value);
+bool tableSetValue(Table* table, Value key, Value value);
+bool tableDeleteValue(Table* table, Value key);
+
+// Marks every key and value in the table.
+void markTable(Table* table);
+
+// Deletes entries whose keys the collector did not mark.
+void tableRemoveWhite(Table* table);
+
 // Copies all entries from one table to another.
 void tableAddAll(Table* from, Table* to);
 
@@ -1,6 +1,8 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "object.h"
 #include "table.h"
@@ -16,6 +18,27 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+// Instruction sets the compiler can target. Chosen once per run, before any
+// code is compiled.
+typedef enum {
+    BACKEND_STACK,
+    BACKEND_REGISTER,
+    BACKEND_C         // Plain stack bytecode for `fls --emit-c` to lower.
+} Backend;
+
+// What the collector has done so far. Times are in nanoseconds; pauses are
+// the time the program was stopped in the collector.
+typedef struct {
+    uint64_t minorCollections;
+    uint64_t fullCollections;
+    uint64_t minorPauseTime;
+    uint64_t maxMinorPause;
+    uint64_t fullPauseTime;
+    uint64_t maxFullPause;
+    uint64_t sweepWaitTime;  // Spent waiting for the background sweeper.
+    uint64_t bytesFreed;
+} GcStats;
+
 // The virtual machine.
 typedef struct {
     CallFrame frames[FRAMES_MAX];
@@ -23,13 +46,29 @@ typedef struct {
 
     Value stack[STACK_MAX];
     Value* stackTop;
-    Table globals;
+    Table globals;            // Global name -> NUMBER_VAL(slot) in globalValues.
+    ValueArray globalValues;  // Indexed by the slots the compiler resolves.
+    ValueArray globalNames;   // Name of each slot, for error messages.
     Table modules;
     Table strings;
-    Obj* objects;
+    Obj* objects;             // Old objects, which survived a collection.
+    Obj* nursery;             // Young objects, allocated since the last one.
     bool hadError;
-    size_t bytesAllocated;
-    size_t nextGC;
+    Backend backend;
+    size_t bytesAllocated;  // Live bytes after the last collection, plus since.
+    size_t nextGC;          // Collect once bytesAllocated passes this.
+    size_t youngBytes;      // Allocated since the last collection.
+    size_t peakBytes;       // The most bytesAllocated has been.
+    size_t softLimit;       // If nonzero, collect before the heap passes it.
+    size_t hardLimit;       // If nonzero, the heap may not grow past it.
+    jmp_buf* errorJump;     // Where interpret() recovers from hitting it.
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;        // Marked objects whose references are unmarked.
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;       // Old objects that may refer to young ones.
+    GcStats gcStats;
 } VM;
 
 typedef enum {
@@ -48,6 +87,13 @@ Value pop();
 void runtimeError(const char* format, ...);
 void defineNative(const char* name, NativeFn function);
 void defineGlobal(const char* name, Value value);
+int globalSlot(ObjString* name);
+bool getGlobal(ObjString* name, Value* value);
+void setGlobal(ObjString* name, Value value);
 void resetStack();
+// Reports that an allocation would take the heap past vm.hardLimit, or that
+// the system could not provide it, and abandons the running script like
+// any other runtime error.
+void heapLimitError();
 
 #endif
@@ -0,0 +1,757 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "error.h"
+#include "memory.h"
+
+// `fls --emit-c` lowers the stack bytecode of a script, and of every module
+// it imports, into C. Each Fls function becomes a C function. The stack
+// depth before every instruction is known statically, so the value at depth
+// d is always slots[d]: instructions become plain assignments between
+// fixed slots, jumps become gotos, and the C compiler is left to keep the
+// slots in registers. The slots stay in vm.stack, so natives and the rest of
+// the runtime see the same stack and CallFrames as under the interpreter,
+// and runtime errors report the same lines and stack traces.
+
+typedef struct {
+  FILE* out;
+  ValueArray functions;  // Every function to emit; its index is its id.
+  ValueArray scripts;    // Top-level function of each module, main first.
+  ValueArray constants;  // Objects the code loads through aotConstants.
+  bool hadError;
+} CEmitter;
+
+static int findValue(ValueArray* array, Value value) {
+  for (int i = 0; i < array->count; i++) {
+    if (valuesEqual(array->values[i], value)) return i;
+  }
+  return -1;
+}
+
+static char* readSource(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = (char*)malloc(fileSize + 1);
+  if (buffer == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  buffer[bytesRead] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+static void collectFunction(CEmitter* ce, ObjFunction* function);
+
+// Compiles the module an import statement names, the first time it is seen.
+static void collectModule(CEmitter* ce, ObjString* path) {
+  for (int i = 0; i < ce->scripts.count; i++) {
+    if (AS_FUNCTION(ce->scripts.values[i])->module->name == path) return;
+  }
+
+  // A module that cannot be read fails at run time, as under the interpreter.
+  char* source = readSource(path->chars);
+  if (source == NULL) return;
+  push(OBJ_VAL(newModule(path)));
+  ObjFunction* script = compile(source, AS_MODULE(vm.stackTop[-1]));
+  pop();
+  free(source);
+  if (script == NULL) {
+    ce->hadError = true;
+    return;
+  }
+
+  // Scripts stay on the VM stack until emitC() returns, which keeps every
+  // function and constant being emitted away from the collector.
+  push(OBJ_VAL(script));
+  writeValueArray(&ce->scripts, OBJ_VAL(script));
+  collectFunction(ce, script);
+}
+
+// Adds the function, the functions it declares and the modules it imports.
+static void collectFunction(CEmitter* ce, ObjFunction* function) {
+  if (findValue(&ce->functions, OBJ_VAL(function)) != -1) return;
+  writeValueArray(&ce->functions, OBJ_VAL(function));
+
+  Chunk* chunk = &function->chunk;
+  int previous = -1;
+  for (int offset = 0; offset < chunk->count;
+       offset += 1 + operandBytes(chunk->code[offset])) {
+    uint8_t instruction = chunk->code[offset];
+    if (instruction == OP_CONSTANT) {
+      Value constant = chunk->constants.values[chunk->code[offset + 1]];
+      if (IS_FUNCTION(constant)) collectFunction(ce, AS_FUNCTION(constant));
+    } else if (instruction == OP_IMPORT && previous != -1 &&
+               chunk->code[previous] == OP_CONSTANT) {
+      // The compiler loads the module path right before importing it.
+      Value path = chunk->constants.values[chunk->code[previous + 1]];
+      collectModule(ce, AS_STRING(path));
+    }
+    previous = offset;
+  }
+}
+
+static int moduleId(CEmitter* ce, ObjModule* module) {
+  for (int i = 0; i < ce->scripts.count; i++) {
+    if (AS_FUNCTION(ce->scripts.values[i])->module == module) return i;
+  }
+  return 0;
+}
+
+static int constantId(CEmitter* ce, Value value) {
+  int id = findValue(&ce->constants, value);
+  if (id != -1) return id;
+  writeValueArray(&ce->constants, value);
+  return ce->constants.count - 1;
+}
+
+static void emitStringLiteral(FILE* out, const char* chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c >= ' ' && c < 0x7f && c != '?') {
+      fputc(c, out);
+    } else {
+      // Always three digits, so a following digit is not read as part of it.
+      fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+static void emitNumber(FILE* out, double number) {
+  if (number != number) {
+    fprintf(out, "NUMBER_VAL(0.0 / 0.0)");
+  } else if (number - number != 0) {
+    fprintf(out, "NUMBER_VAL(%s1.0 / 0.0)", number < 0 ? "-" : "");
+  } else {
+    // %a round-trips every double exactly.
+    fprintf(out, "NUMBER_VAL(%a)", number);
+  }
+}
+
+// Fills 'depths' with the stack depth before every reachable instruction
+// (-1 for dead code) and 'targets' with the offsets jumps land on. Returns
+// the deepest the stack gets.
+static int findDepths(ObjFunction* function, int* depths, bool* targets) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count; offset++) {
+    depths[offset] = -1;
+    targets[offset] = false;
+  }
+
+  // Offsets still to walk from. Loops jump backwards to code the walk may
+  // not have reached yet, so a jump target is queued the first time it is
+  // seen and each straight-line run is walked once.
+  int* pending = ALLOCATE(int, chunk->count + 1);
+  int pendingCount = 0;
+  int maxDepth = function->arity + 1;
+  depths[0] = maxDepth;
+  pending[pendingCount++] = 0;
+
+  while (pendingCount > 0) {
+    int offset = pending[--pendingCount];
+    int depth = depths[offset];
+    for (;;) {
+      uint8_t instruction = chunk->code[offset];
+      int next = offset + 1 + operandBytes(instruction);
+      if (isJump(instruction)) {
+        int target = jumpTarget(chunk, offset);
+        targets[target] = true;
+        if (depths[target] == -1) {
+          depths[target] = depth;
+          pending[pendingCount++] = target;
+        }
+      }
+      depth += stackEffect(chunk, offset);
+      if (depth > maxDepth) maxDepth = depth;
+
+      if (instruction == OP_JUMP || instruction == OP_LOOP ||
+          instruction == OP_RETURN || next >= chunk->count ||
+          depths[next] != -1) {
+        break;
+      }
+      depths[next] = depth;
+      offset = next;
+    }
+  }
+
+  FREE_ARRAY(int, pending, chunk->count + 1);
+  return maxDepth;
+}
+
+static void emitBinaryNumbers(FILE* out, int offset, int a, int b,
+                              const char* result, const char* op) {
+  fprintf(out, "  if (!IS_NUMBER(slots[%d]) || !IS_NUMBER(slots[%d])) {\n",
+          a, b);
+  fprintf(out, "    AT(%d);\n", offset);
+  fprintf(out, "    aotError(\"Operands must be numbers.\");\n");
+  fprintf(out, "  }\n");
+  fprintf(out, "  slots[%d] = %s(AS_NUMBER(slots[%d]) %s AS_NUMBER(slots[%d]));\n",
+          a, result, a, op, b);
+}
+
+// Writes the C for the instruction at 'offset', which starts with 'depth'
+// values on the stack. Returns false for instructions with no C form.
+static bool emitInstruction(CEmitter* ce, ObjFunction* function, int offset,
+                            int depth, int maxDepth) {
+  FILE* out = ce->out;
+  Chunk* chunk = &function->chunk;
+  uint8_t* operands = &chunk->code[offset + 1];
+  int top = depth - 1;
+
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT: {
+      Value constant = chunk->constants.values[operands[0]];
+      fprintf(out, "  slots[%d] = ", depth);
+      if (IS_NUMBER(constant)) {
+        emitNumber(out, AS_NUMBER(constant));
+      } else {
+        fprintf(out, "CONSTANT(%d)", constantId(ce, constant));
+      }
+      fprintf(out, ";\n");
+      break;
+    }
+    case OP_NIL:
+      fprintf(out, "  slots[%d] = NIL_VAL;\n", depth);
+      break;
+    case OP_TRUE:
+      fprintf(out, "  slots[%d] = BOOL_VAL(true);\n", depth);
+      break;
+    case OP_FALSE:
+      fprintf(out, "  slots[%d] = BOOL_VAL(false);\n", depth);
+      break;
+    case OP_POP:
+      break;
+    case OP_GET_LOCAL:
+      fprintf(out, "  slots[%d] = slots[%d];\n", depth, operands[0]);
+      break;
+    case OP_SET_LOCAL:
+      fprintf(out, "  slots[%d] = slots[%d];\n", operands[0], top);
+      break;
+    case OP_GET_GLOBAL_SLOT:
+    case OP_SET_GLOBAL_SLOT: {
+      int slot = (operands[0] << 8) | operands[1];
+      fprintf(out, "  if (IS_UNDEFINED(GLOBAL(%d))) {\n", slot);
+      fprintf(out, "    AT(%d);\n", offset);
+      fprintf(out, "    aotError(\"Undefined variable '%%s'.\", "
+                   "AS_CSTRING(vm.globalNames.values[aotGlobalSlots[%d]]));\n",
+              slot);
+      fprintf(out, "  }\n");
+      if (chunk->code[offset] == OP_GET_GLOBAL_SLOT) {
+        fprintf(out, "  slots[%d] = GLOBAL(%d);\n", depth, slot);
+      } else {
+        fprintf(out, "  GLOBAL(%d) = slots[%d];\n", slot, top);
+      }
+      break;
+    }
+    case OP_DEFINE_GLOBAL_SLOT:
+      fprintf(out, "  GLOBAL(%d) = slots[%d];\n",
+              (operands[0] << 8) | operands[1], top);
+      break;
+    case OP_EQUAL:
+      fprintf(out, "  slots[%d] = BOOL_VAL(valuesEqual(slots[%d], slots[%d]));\n",
+              top - 1, top - 1, top);
+      break;
+    case OP_GREATER:
+      emitBinaryNumbers(out, offset, top - 1, top, "BOOL_VAL", ">");
+      break;
+    case OP_LESS:
+      emitBinaryNumbers(out, offset, top - 1, top, "BOOL_VAL", "<");
+      break;
+    case OP_ADD:
+      fprintf(out, "  if (IS_NUMBER(slots[%d]) && IS_NUMBER(slots[%d])) {\n",
+              top - 1, top);
+      fprintf(out, "    slots[%d] = NUMBER_VAL(AS_NUMBER(slots[%d]) + "
+                   "AS_NUMBER(slots[%d]));\n", top - 1, top - 1, top);
+      fprintf(out, "  } else {\n");
+      fprintf(out, "    AT(%d);\n", offset);
+      fprintf(out, "    slots[%d] = aotAdd(slots[%d], slots[%d]);\n",
+              top - 1, top - 1, top);
+      fprintf(out, "  }\n");
+      break;
+    case OP_SUBTRACT:
+      emitBinaryNumbers(out, offset, top - 1, top, "NUMBER_VAL", "-");
+      break;
+    case OP_MULTIPLY:
+      emitBinaryNumbers(out, offset, top - 1, top, "NUMBER_VAL", "*");
+      break;
+    case OP_DIVIDE:
+      emitBinaryNumbers(out, offset, top - 1, top, "NUMBER_VAL", "/");
+      break;
+    case OP_MODULO:
+      fprintf(out, "  if (!IS_NUMBER(slots[%d]) || !IS_NUMBER(slots[%d])) {\n",
+              top - 1, top);
+      fprintf(out, "    AT(%d);\n", offset);
+      fprintf(out, "    aotError(\"Operands must be numbers.\");\n");
+      fprintf(out, "  }\n");
+      fprintf(out, "  slots[%d] = NUMBER_VAL(fmod(AS_NUMBER(slots[%d]), "
+                   "AS_NUMBER(slots[%d])));\n", top - 1, top - 1, top);
+      break;
+    case OP_NOT:
+      fprintf(out, "  slots[%d] = BOOL_VAL(aotIsFalsey(slots[%d]));\n", top, top);
+      break;
+    case OP_NEGATE:
+      fprintf(out, "  if (!IS_NUMBER(slots[%d])) {\n", top);
+      fprintf(out, "    AT(%d);\n", offset);
+      fprintf(out, "    aotError(\"Operand must be a number.\");\n");
+      fprintf(out, "  }\n");
+      fprintf(out, "  slots[%d] = NUMBER_VAL(-AS_NUMBER(slots[%d]));\n", top, top);
+      break;
+    case OP_PRINT:
+      fprintf(out, "  printValue(slots[%d]);\n", top);
+      fprintf(out, "  printf(\"\\n\");\n");
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      fprintf(out, "  goto L%d;\n", jumpTarget(chunk, offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      fprintf(out, "  if (aotIsFalsey(slots[%d])) goto L%d;\n",
+              top, jumpTarget(chunk, offset));
+      break;
+    case OP_TAIL_CALL: {
+      int callee = depth - operands[0] - 1;
+      // A function calling itself starts over with the new arguments.
+      if (operands[0] == function->arity) {
+        fprintf(out, "  if (IS_FUNCTION(slots[%d]) && "
+                     "AS_FUNCTION(slots[%d]) == frame->function) {\n",
+                callee, callee);
+        for (int i = 1; i <= operands[0]; i++) {
+          fprintf(out, "    slots[%d] = slots[%d];\n", i, callee + i);
+        }
+        fprintf(out, "    goto start;\n");
+        fprintf(out, "  }\n");
+      }
+      // Other functions take over the frame. The C call is in tail position
+      // with the same signature, so optimizing compilers turn it into a jump.
+      fprintf(out, "  AT(%d);\n", offset);
+      fprintf(out, "  if (aotTailCall(slots, &slots[%d], %d)) "
+                   "return frame->function->aot(slots);\n",
+              callee, operands[0]);
+      fprintf(out, "  vm.stackTop = slots + %d;\n", maxDepth);
+      break;
+    }
+    case OP_CALL: {
+      int callee = depth - operands[0] - 1;
+      fprintf(out, "  AT(%d);\n", offset);
+      fprintf(out, "  slots[%d] = aotCall(&slots[%d], %d);\n",
+              callee, callee, operands[0]);
+      fprintf(out, "  vm.stackTop = slots + %d;\n", maxDepth);
+      break;
+    }
+    case OP_NEW_LIST:
+      fprintf(out, "  slots[%d] = OBJ_VAL(newList());\n", depth);
+      break;
+    case OP_LIST_APPEND:
+      fprintf(out, "  listAppend(AS_LIST(slots[%d]), slots[%d]);\n",
+              top - 1, top);
+      fprintf(out, "  writeBarrier(AS_OBJ(slots[%d]), slots[%d]);\n",
+              top - 1, top);
+      break;
+    case OP_GET_SUBSCRIPT:
+      fprintf(out, "  AT(%d);\n", offset);
+      fprintf(out, "  slots[%d] = aotGetSubscript(slots[%d], slots[%d]);\n",
+              top - 1, top - 1, top);
+      break;
+    case OP_SET_SUBSCRIPT:
+      fprintf(out, "  AT(%d);\n", offset);
+      fprintf(out, "  slots[%d] = aotSetSubscript(slots[%d], slots[%d], "
+                   "slots[%d]);\n", top - 2, top - 2, top - 1, top);
+      break;
+    case OP_IMPORT:
+      fprintf(out, "  AT(%d);\n", offset);
+      fprintf(out, "  slots[%d] = aotImport(&slots[%d]);\n", top, top);
+      fprintf(out, "  vm.stackTop = slots + %d;\n", maxDepth);
+      break;
+    case OP_EXPORT: {
+      Value name = chunk->constants.values[operands[0]];
+      fprintf(out, "  AT(%d);\n", offset);
+      fprintf(out, "  aotExport(AS_STRING(CONSTANT(%d)), slots[%d]);\n",
+              constantId(ce, name), top);
+      break;
+    }
+    case OP_RETURN:
+      fprintf(out, "  return slots[%d];\n", top);
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+static void emitFunction(CEmitter* ce, int id) {
+  FILE* out = ce->out;
+  ObjFunction* function = AS_FUNCTION(ce->functions.values[id]);
+  Chunk* chunk = &function->chunk;
+  int* depths = ALLOCATE(int, chunk->count);
+  bool* targets = ALLOCATE(bool, chunk->count);
+  int maxDepth = findDepths(function, depths, targets);
+
+  fprintf(out, "// %s\n", function->name != NULL
+                              ? function->name->chars
+                              : function->module->name->chars);
+  fprintf(out, "static Value fn%d(Value* slots) {\n", id);
+  fprintf(out, "  CallFrame* frame = &vm.frames[vm.frameCount - 1];\n");
+  fprintf(out, "  (void)frame;\n");
+  if (maxDepth > function->arity + 1) {
+    fprintf(out, "  for (int i = %d; i < %d; i++) slots[i] = NIL_VAL;\n",
+            function->arity + 1, maxDepth);
+  }
+  // The caller's slots above this frame stay roots while it runs; slots
+  // that were not roots before hold nil from here on.
+  fprintf(out, "  if (vm.stackTop < slots + %d) vm.stackTop = slots + %d;\n",
+          maxDepth, maxDepth);
+  for (int offset = 0; offset < chunk->count;
+       offset += 1 + operandBytes(chunk->code[offset])) {
+    if (chunk->code[offset] == OP_TAIL_CALL &&
+        chunk->code[offset + 1] == function->arity) {
+      fprintf(out, "start:;\n");
+      break;
+    }
+  }
+
+  for (int offset = 0; offset < chunk->count;
+       offset += 1 + operandBytes(chunk->code[offset])) {
+    if (depths[offset] == -1) continue;
+    if (targets[offset]) fprintf(out, "L%d:;\n", offset);
+    if (!emitInstruction(ce, function, offset, depths[offset], maxDepth)) {
+      fprintf(stderr, "Cannot compile opcode %d to C.\n", chunk->code[offset]);
+      ce->hadError = true;
+      break;
+    }
+  }
+  fprintf(out, "}\n\n");
+
+  FREE_ARRAY(int, depths, chunk->count);
+  FREE_ARRAY(bool, targets, chunk->count);
+}
+
+static void emitLines(CEmitter* ce, int id) {
+  Chunk* chunk = &AS_FUNCTION(ce->functions.values[id])->chunk;
+  fprintf(ce->out, "static const LineStart lines%d[] = {", id);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    if (i % 8 == 0) fprintf(ce->out, "\n ");
+    fprintf(ce->out, " {%d, %d},", chunk->lines[i].offset, chunk->lines[i].line);
+  }
+  fprintf(ce->out, "\n};\n\n");
+}
+
+static void emitMain(CEmitter* ce) {
+  FILE* out = ce->out;
+  fprintf(out, "static const char* const globalNames[] = {\n");
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    ObjString* name = AS_STRING(vm.globalNames.values[i]);
+    fprintf(out, "  ");
+    emitStringLiteral(out, name->chars, name->length);
+    fprintf(out, ",\n");
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "int main(void) {\n");
+  fprintf(out, "  initVM();\n");
+  for (int i = 0; i < ce->scripts.count; i++) {
+    ObjString* path = AS_FUNCTION(ce->scripts.values[i])->module->name;
+    fprintf(out, "  ObjModule* module%d = aotModule(", i);
+    emitStringLiteral(out, path->chars, path->length);
+    fprintf(out, ");\n");
+  }
+  for (int i = 0; i < ce->functions.count; i++) {
+    ObjFunction* function = AS_FUNCTION(ce->functions.values[i]);
+    fprintf(out, "  ObjFunction* function%d = aotFunction(module%d, ", i,
+            moduleId(ce, function->module));
+    if (function->name == NULL) {
+      fprintf(out, "NULL");
+    } else {
+      emitStringLiteral(out, function->name->chars, function->name->length);
+    }
+    fprintf(out, ", %d, fn%d, lines%d, %d, %d);\n", function->arity, i, i,
+            function->chunk.lineCount, function->chunk.count);
+  }
+  for (int i = 0; i < ce->constants.count; i++) {
+    Value constant = ce->constants.values[i];
+    fprintf(out, "  aotConstant(OBJ_VAL(");
+    if (IS_FUNCTION(constant)) {
+      fprintf(out, "function%d", findValue(&ce->functions, constant));
+    } else {
+      ObjString* string = AS_STRING(constant);
+      fprintf(out, "copyString(");
+      emitStringLiteral(out, string->chars, string->length);
+      fprintf(out, ", %d)", string->length);
+    }
+    fprintf(out, "));\n");
+  }
+  for (int i = 0; i < ce->functions.count; i++) {
+    fprintf(out, "  (void)function%d;\n", i);
+  }
+  fprintf(out, "  aotResolveGlobals(globalNames, %d);\n", vm.globalNames.count);
+  fprintf(out, "  aotRun(function0);\n");
+  fprintf(out, "  freeVM();\n");
+  fprintf(out, "  return 0;\n");
+  fprintf(out, "}\n");
+}
+
+bool emitC(const char* path, const char* source, FILE* out) {
+  CEmitter ce;
+  ce.out = out;
+  ce.hadError = false;
+  initValueArray(&ce.functions);
+  initValueArray(&ce.scripts);
+  initValueArray(&ce.constants);
+  Value* stackBase = vm.stackTop;
+
+  push(OBJ_VAL(copyString(path, strlen(path))));
+  vm.stackTop[-1] = OBJ_VAL(newModule(AS_STRING(vm.stackTop[-1])));
+  ObjFunction* script = compile(source, AS_MODULE(vm.stackTop[-1]));
+  pop();
+  if (script == NULL) return false;
+  push(OBJ_VAL(script));
+  writeValueArray(&ce.scripts, OBJ_VAL(script));
+  collectFunction(&ce, script);
+
+  if (!ce.hadError) {
+    fprintf(out, "// Generated by `fls --emit-c %s`. Build it against every "
+                 "source in build.toml\n", path);
+    fprintf(out, "// except src/main.c, e.g.\n");
+    fprintf(out, "//   cc -O2 -Iinclude -Istd/include <this file> <sources> "
+                 "-lm -pthread\n\n");
+    // -Istd/include puts the Fls math library's header in front of <math.h>.
+    fprintf(out, "#include <stdio.h>\n\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    fprintf(out, "double fmod(double x, double y);\n\n");
+    fprintf(out, "#define AT(offset) (frame->ip = frame->function->chunk.code "
+                 "+ (offset) + 1)\n");
+    fprintf(out, "#define GLOBAL(slot) "
+                 "(vm.globalValues.values[aotGlobalSlots[slot]])\n");
+    fprintf(out, "#define CONSTANT(index) (aotConstants.values[index])\n\n");
+
+    for (int i = 0; i < ce.functions.count; i++) {
+      fprintf(out, "static Value fn%d(Value* slots);\n", i);
+    }
+    fprintf(out, "\n");
+    for (int i = 0; i < ce.functions.count && !ce.hadError; i++) {
+      emitLines(&ce, i);
+      emitFunction(&ce, i);
+    }
+    if (!ce.hadError) emitMain(&ce);
+  }
+
+  freeValueArray(&ce.functions);
+  freeValueArray(&ce.scripts);
+  freeValueArray(&ce.constants);
+  vm.stackTop = stackBase;
+  return !ce.hadError;
+}
+
+// Runtime support.
+
+ValueArray aotConstants;
+int* aotGlobalSlots;
+Table aotModules;
+
+// Modules and functions main() creates. Until they are constants or are
+// called, nothing but a C local refers to them.
+static ValueArray aotObjects;
+
+static void aotKeep(Obj* object) {
+  push(OBJ_VAL(object));
+  writeValueArray(&aotObjects, OBJ_VAL(object));
+  pop();
+}
+
+void markAotRoots() {
+  for (int i = 0; i < aotConstants.count; i++) {
+    markValue(aotConstants.values[i]);
+  }
+  for (int i = 0; i < aotObjects.count; i++) {
+    markValue(aotObjects.values[i]);
+  }
+  markTable(&aotModules);
+}
+
+ObjModule* aotModule(const char* path) {
+  push(OBJ_VAL(copyString(path, (int)strlen(path))));
+  ObjModule* module = newModule(AS_STRING(vm.stackTop[-1]));
+  aotKeep((Obj*)module);
+  pop();
+  return module;
+}
+
+ObjFunction* aotFunction(ObjModule* module, const char* name, int arity,
+                         AotFn body, const LineStart* lines, int lineCount,
+                         int count) {
+  ObjFunction* function = newFunction();
+  aotKeep((Obj*)function);
+  function->arity = arity;
+  function->module = module;
+  function->aot = body;
+  if (name != NULL) {
+    function->name = copyString(name, (int)strlen(name));
+    writeBarrier((Obj*)function, OBJ_VAL(function->name));
+  }
+
+  // The code itself is never run; it is only there so that runtime errors
+  // can find the line of the instruction a frame's ip points at.
+  for (int i = 0; i < lineCount; i++) {
+    int end = i + 1 < lineCount ? lines[i + 1].offset : count;
+    for (int offset = lines[i].offset; offset < end; offset++) {
+      writeChunk(&function->chunk, 0, lines[i].line);
+    }
+  }
+
+  if (name == NULL) tableSet(&aotModules, module->name, OBJ_VAL(function));
+  return function;
+}
+
+void aotConstant(Value value) {
+  push(value);
+  writeValueArray(&aotConstants, value);
+  pop();
+}
+
+void aotResolveGlobals(const char* const* names, int count) {
+  aotGlobalSlots = ALLOCATE(int, count);
+  for (int i = 0; i < count; i++) {
+    aotGlobalSlots[i] = globalSlot(copyString(names[i], (int)strlen(names[i])));
+  }
+}
+
+void aotRun(ObjFunction* script) {
+  push(OBJ_VAL(script));
+  aotCall(vm.stackTop - 1, 0);
+}
+
+void aotError(const char* format, ...) {
+  char message[1024];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  runtimeError("%s", message);
+  exit(70);
+}
+
+Value aotCall(Value* callee, int argCount) {
+  if (IS_OBJ(*callee)) {
+    switch (OBJ_TYPE(*callee)) {
+      case OBJ_FUNCTION: {
+        ObjFunction* function = AS_FUNCTION(*callee);
+        if (argCount != function->arity) {
+          aotError("Expected %d arguments but got %d.", function->arity,
+                   argCount);
+        }
+        if (vm.frameCount == FRAMES_MAX) aotError("Stack overflow.");
+
+        CallFrame* frame = &vm.frames[vm.frameCount++];
+        frame->function = function;
+        frame->ip = function->chunk.code;
+        frame->slots = callee;
+        Value result = function->aot(callee);
+        vm.frameCount--;
+        return result;
+      }
+      case OBJ_NATIVE: {
+        // vm.stackTop stays above the caller's slots, keeping them roots.
+        Value result = AS_NATIVE(*callee)(argCount, callee + 1);
+        if (vm.hadError) exit(70);
+        return result;
+      }
+      default:
+        break;  // Non-callable object type.
+    }
+  }
+  aotError("Can only call functions and classes.");
+  return NIL_VAL;
+}
+
+// Moves the function in 'callee' and its arguments down over the current
+// frame and returns true, for the caller to run the function's body in its
+// place. Anything else is called normally, leaving the result in 'callee'.
+bool aotTailCall(Value* slots, Value* callee, int argCount) {
+  if (!IS_FUNCTION(*callee)) {
+    *callee = aotCall(callee, argCount);
+    return false;
+  }
+
+  ObjFunction* function = AS_FUNCTION(*callee);
+  if (argCount != function->arity) {
+    aotError("Expected %d arguments but got %d.", function->arity, argCount);
+  }
+  memmove(slots, callee, sizeof(Value) * (argCount + 1));
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  frame->function = function;
+  frame->ip = function->chunk.code;
+  return true;
+}
+
+Value aotAdd(Value a, Value b) {
+  if (IS_STRING(a) && IS_STRING(b)) {
+    return OBJ_VAL(concatenateStrings(AS_OBJ(a), AS_OBJ(b)));
+  }
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+  }
+  aotError("Operands must be two numbers or two strings.");
+  return NIL_VAL;
+}
+
+static int listIndex(Value list, Value index) {
+  if (!IS_LIST(list)) aotError("Can only subscript lists.");
+  if (!IS_NUMBER(index)) aotError("List index must be a number.");
+
+  ValueArray* items = &AS_LIST(list)->items;
+  int i = AS_NUMBER(index);
+  if (i < 0) i = items->count + i;
+  if (i < 0 || i >= items->count) aotError("List index out of bounds.");
+  return i;
+}
+
+Value aotGetSubscript(Value list, Value index) {
+  int i = listIndex(list, index);
+  return AS_LIST(list)->items.values[i];
+}
+
+Value aotSetSubscript(Value list, Value index, Value value) {
+  int i = listIndex(list, index);
+  AS_LIST(list)->items.values[i] = value;
+  writeBarrier(AS_OBJ(list), value);
+  return value;
+}
+
+// Runs the module the first time it is imported, like the interpreter, and
+// returns the value its top-level code leaves.
+Value aotImport(Value* name) {
+  ObjString* path = AS_STRING(*name);
+  Value module;
+  if (tableGet(&vm.modules, path, &module)) return module;
+
+  Value script;
+  if (!tableGet(&aotModules, path, &script)) {
+    aotError("Could not open module '%s'.", path->chars);
+  }
+  tableSet(&vm.modules, path, OBJ_VAL(AS_FUNCTION(script)->module));
+  *name = script;
+  return aotCall(name, 0);
+}
+
+void aotExport(ObjString* name, Value value) {
+  ObjModule* module = vm.frames[vm.frameCount - 1].function->module;
+  if (module == NULL) aotError("Cannot export from top-level script.");
+  tableSet(&module->variables, name, value);
+  writeBarrier((Obj*)module, OBJ_VAL(name));
+  writeBarrier((Obj*)module, value);
+}
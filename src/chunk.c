@@ -2,36 +2,165 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
-        int oldCapacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(chunk->capacity);
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, capacity);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    // Consecutive bytes almost always share a line, so only start a new run
+    // when the line changes.
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+        return;
+    }
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int capacity = GROW_CAPACITY(chunk->lineCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, chunk->lineCapacity, capacity);
+        chunk->lineCapacity = capacity;
+    }
+    LineStart* start = &chunk->lines[chunk->lineCount++];
+    start->offset = chunk->count - 1;
+    start->line = line;
 }
 
 int addConstant(Chunk* chunk, Value value) {
+    // Keep the value reachable while the constant array grows.
+    push(value);
     writeValueArray(&chunk->constants, value);
+    pop();
     return chunk->constants.count - 1;
 }
+
+int getLine(Chunk* chunk, int offset) {
+    // Find the last run that starts at or before 'offset'.
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return chunk->lineCount == 0 ? 0 : chunk->lines[low].line;
+}
+
+void replaceCode(Chunk* chunk, Chunk* from) {
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->count = from->count;
+    chunk->capacity = from->capacity;
+    chunk->code = from->code;
+    chunk->lineCount = from->lineCount;
+    chunk->lineCapacity = from->lineCapacity;
+    chunk->lines = from->lines;
+    freeValueArray(&from->constants);
+    initChunk(from);
+}
+
+// Returns the number of operand bytes following an opcode.
+int operandBytes(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_EXPORT_VAR:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_EXPORT:
+        case OP_SET_LOCAL_POP:
+            return 1;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCALS:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+        case OP_CONSTANT_CALL:
+        case OP_JUMP_IF_FALSE_OR_POP:
+            return 2;
+        case OP_LESS_LOCALS_JUMP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+// Returns how many values the instruction at 'offset' pushes, less the
+// number it pops.
+int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_NEW_LIST:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_LIST_APPEND:
+        case OP_PRINT:
+        case OP_GET_SUBSCRIPT:
+        case OP_RETURN:
+            return -1;
+        case OP_SET_SUBSCRIPT:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -chunk->code[offset + 1];
+        default:
+            return 0;
+    }
+}
+
+bool isJump(uint8_t opcode) {
+    return opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP;
+}
+
+int jumpTarget(Chunk* chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
@@ -69,6 +69,9 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+
+    // Offset of the last OP_CALL emitted, so a return can make it a tail call.
+    int lastCall;
 } Compiler;
 
 Parser parser;
@@ -79,11 +82,8 @@ static Chunk* currentChunk() {
     return &current->function->chunk;
 }
 
-// Reports an error at a specific token.
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
-
+// Prints an error with the source line of a specific token.
+static void printErrorAt(Token* token, bool isCompileError, const char* message) {
     const char* lineStart = token->start;
     while (lineStart > parser.lexer->start && *(lineStart - 1) != '\n') {
         lineStart--;
@@ -105,9 +105,16 @@ static void errorAt(Token* token, const char* message) {
     lineStr[lineLength] = '\0';
 
     const char* moduleName = parser.module->name != NULL ? parser.module->name->chars : "<script>";
-    reportError(true, moduleName, token->line, lineStr, col, token->length, message);
+    reportError(isCompileError, moduleName, token->line, lineStr, col, token->length, message);
 
     free(lineStr);
+}
+
+// Reports an error at a specific token.
+static void errorAt(Token* token, const char* message) {
+    if (parser.panicMode) return;
+    parser.panicMode = true;
+    printErrorAt(token, true, message);
     parser.hadError = true;
 }
 
@@ -166,6 +173,13 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+// Emits an instruction with a two-byte operand.
+static void emitShortOp(uint8_t instruction, uint16_t operand) {
+    emitByte(instruction);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+}
+
 // Emits a loop instruction.
 static void emitLoop(int loopStart) {
     emitByte(OP_LOOP);
@@ -194,6 +208,7 @@ static void emitReturn() {
 // Creates a constant in the chunk and returns its index.
 static uint8_t makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
+    writeBarrier((Obj*)current->function, value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -227,12 +242,14 @@ static void initCompiler(Compiler* compiler, FunctionType type, ObjModule* modul
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
     compiler->function = newFunction();
     compiler->function->module = module;
     current = compiler;
 
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->localCount++];
@@ -241,15 +258,186 @@ static void initCompiler(Compiler* compiler, FunctionType type, ObjModule* modul
     local->name.length = 0;
 }
 
+#ifdef FLS_SUPERINSTRUCTIONS
+
+// A run of instructions that executes as a single dispatch.
+typedef struct {
+    uint8_t fused;
+    int length;
+    uint8_t sequence[5];
+} Superinstruction;
+
+// Fusion candidates, taken from DEBUG_PROFILE_OPCODES runs over the example
+// and benchmark scripts. Longer runs come first so they win over their
+// prefixes. Regenerate by profiling with FLS_NO_SUPERINSTRUCTIONS defined.
+static const Superinstruction superinstructions[] = {
+    {OP_LESS_LOCALS_JUMP, 5,
+     {OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS, OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_LESS_LOCAL_CONSTANT_JUMP, 5,
+     {OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_ADD_LOCALS, 3, {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD}},
+    {OP_ADD_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD}},
+    {OP_SUBTRACT_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT}},
+    {OP_NOT_EQUAL, 2, {OP_EQUAL, OP_NOT}},
+    {OP_CONSTANT_CALL, 2, {OP_CONSTANT, OP_CALL}},
+    {OP_SET_LOCAL_POP, 2, {OP_SET_LOCAL, OP_POP}},
+    {OP_JUMP_IF_FALSE_OR_POP, 2, {OP_JUMP_IF_FALSE, OP_POP}},
+};
+
+// A jump operand to rewrite once every instruction's new offset is known.
+typedef struct {
+    int operand;  // Offset of the operand in the new code.
+    int target;   // Offset of the jump target in the old code.
+    int from;     // New offset the jump is relative to.
+    int sign;     // -1 for OP_LOOP.
+} JumpFixup;
+
+// Returns the superinstruction starting at 'offset', if any. A run can only
+// be fused if nothing jumps into the middle of it.
+static const Superinstruction* matchSuperinstruction(Chunk* chunk, int offset,
+                                                     bool* isTarget) {
+    int count = sizeof(superinstructions) / sizeof(superinstructions[0]);
+    for (int i = 0; i < count; i++) {
+        const Superinstruction* candidate = &superinstructions[i];
+        int at = offset;
+        int matched = 0;
+        while (matched < candidate->length && at < chunk->count &&
+               chunk->code[at] == candidate->sequence[matched] &&
+               (matched == 0 || !isTarget[at])) {
+            at += 1 + operandBytes(chunk->code[at]);
+            matched++;
+        }
+        if (matched == candidate->length) return candidate;
+    }
+    return NULL;
+}
+
+// The scratch space of the fusion in progress, NULL when there is none. It
+// lives here rather than on the stack so that abandonCompilation() can free
+// it if running out of memory unwinds out of fuseSuperinstructions().
+static struct {
+    int count;
+    bool* isTarget;
+    int* newOffsets;
+    JumpFixup* fixups;
+    Chunk fused;
+} fusing;
+
+static void freeFusion() {
+    if (fusing.isTarget != NULL) {
+        FREE_ARRAY(bool, fusing.isTarget, fusing.count + 1);
+    }
+    if (fusing.newOffsets != NULL) {
+        FREE_ARRAY(int, fusing.newOffsets, fusing.count + 1);
+    }
+    if (fusing.fixups != NULL) {
+        FREE_ARRAY(JumpFixup, fusing.fixups, fusing.count);
+    }
+    fusing.isTarget = NULL;
+    fusing.newOffsets = NULL;
+    fusing.fixups = NULL;
+    freeChunk(&fusing.fused);
+}
+
+// Rewrites a finished chunk, replacing runs of instructions with their
+// superinstructions and relocating every jump across the shortened code.
+static void fuseSuperinstructions(Chunk* chunk) {
+    int count = chunk->count;
+    fusing.count = count;
+    fusing.isTarget = ALLOCATE(bool, count + 1);
+    fusing.newOffsets = ALLOCATE(int, count + 1);
+    fusing.fixups = ALLOCATE(JumpFixup, count);
+    bool* isTarget = fusing.isTarget;
+    int* newOffsets = fusing.newOffsets;
+    JumpFixup* fixups = fusing.fixups;
+    Chunk* fused = &fusing.fused;
+
+    memset(isTarget, 0, sizeof(bool) * (count + 1));
+    for (int offset = 0; offset < count;
+         offset += 1 + operandBytes(chunk->code[offset])) {
+        if (isJump(chunk->code[offset])) {
+            isTarget[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    int fixupCount = 0;
+    for (int offset = 0; offset < count;) {
+        const Superinstruction* fusion =
+            matchSuperinstruction(chunk, offset, isTarget);
+        int length = fusion != NULL ? fusion->length : 1;
+        int start = fused->count;
+        int firstFixup = fixupCount;
+
+        if (fusion != NULL) {
+            writeChunk(fused, fusion->fused, getLine(chunk, offset));
+        }
+
+        for (int i = 0; i < length; i++) {
+            uint8_t instruction = chunk->code[offset];
+            int operands = operandBytes(instruction);
+            newOffsets[offset] = start;
+
+            if (fusion == NULL) {
+                writeChunk(fused, instruction, getLine(chunk, offset));
+            }
+            if (isJump(instruction)) {
+                JumpFixup* fixup = &fixups[fixupCount++];
+                fixup->operand = fused->count;
+                fixup->target = jumpTarget(chunk, offset);
+                fixup->sign = instruction == OP_LOOP ? -1 : 1;
+            }
+            for (int j = 1; j <= operands; j++) {
+                writeChunk(fused, chunk->code[offset + j],
+                           getLine(chunk, offset + j));
+            }
+            offset += 1 + operands;
+        }
+
+        for (int i = firstFixup; i < fixupCount; i++) {
+            fixups[i].from = fused->count;
+        }
+    }
+    newOffsets[count] = fused->count;
+
+    // Fusion only ever shortens code, so every jump still fits its operand.
+    for (int i = 0; i < fixupCount; i++) {
+        JumpFixup* fixup = &fixups[i];
+        int jump = fixup->sign * (newOffsets[fixup->target] - fixup->from);
+        fused->code[fixup->operand] = (jump >> 8) & 0xff;
+        fused->code[fixup->operand + 1] = jump & 0xff;
+    }
+
+    replaceCode(chunk, fused);
+    freeFusion();
+}
+
+#endif
+
 // Finishes compilation and returns the compiled function.
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
 
+    if (!parser.hadError && vm.backend == BACKEND_REGISTER) {
+        if (!compileRegisters(function)) {
+            error("Function needs too many registers.");
+        }
+    }
+#ifdef FLS_SUPERINSTRUCTIONS
+    else if (!parser.hadError && vm.backend == BACKEND_STACK) {
+        fuseSuperinstructions(currentChunk());
+    }
+#endif
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL
-            ? function->name->chars : "<script>");
+        const char* name = function->name != NULL
+            ? function->name->chars : "<script>";
+        if (vm.backend == BACKEND_REGISTER) {
+            disassembleRegisterChunk(currentChunk(), name);
+        } else {
+            disassembleChunk(currentChunk(), name);
+        }
     }
 #endif
 
@@ -326,6 +514,7 @@ static uint8_t argumentList() {
 
 static void call(bool canAssign) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -418,6 +607,17 @@ static uint8_t identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+// Resolves a global variable to its slot in the VM's global value array.
+static uint16_t resolveGlobal(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
 // Adds a local variable to the compiler's list.
 static void addLocal(Token name) {
     if (current->localCount == UINT8_COUNT) {
@@ -449,14 +649,14 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-// Parses a variable name.
-static uint8_t parseVariable(const char* errorMessage) {
+// Parses a variable name and returns its global slot (0 for locals).
+static uint16_t parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return resolveGlobal(&parser.previous);
 }
 
 // Marks the last declared local variable as initialized.
@@ -466,33 +666,34 @@ static void markInitialized() {
 }
 
 // Defines a variable by emitting the appropriate instruction.
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitShortOp(OP_DEFINE_GLOBAL_SLOT, global);
 }
 
 // Parses a variable expression.
 static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
     if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
-    } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        if (canAssign && match(TOKEN_EQUAL)) {
+            expression();
+            emitBytes(OP_SET_LOCAL, (uint8_t)arg);
+        } else {
+            emitBytes(OP_GET_LOCAL, (uint8_t)arg);
+        }
+        return;
     }
 
+    uint16_t slot = resolveGlobal(&name);
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitShortOp(OP_SET_GLOBAL_SLOT, slot);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitShortOp(OP_GET_GLOBAL_SLOT, slot);
     }
 }
 
@@ -626,7 +827,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            uint16_t constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -649,20 +850,22 @@ static void importStatement() {
 }
 
 static void funDeclaration(bool isExport) {
-    uint8_t global = parseVariable("Expect function name.");
+    uint16_t global = parseVariable("Expect function name.");
+    Token name = parser.previous;
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 
     if (isExport) {
-        emitBytes(OP_EXPORT, global);
+        emitBytes(OP_EXPORT, identifierConstant(&name));
     }
 }
 
 // ...
 
 static void varDeclaration(bool isExport) {
-    uint8_t global = parseVariable("Expect variable name.");
+    uint16_t global = parseVariable("Expect variable name.");
+    Token name = parser.previous;
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -674,7 +877,7 @@ static void varDeclaration(bool isExport) {
     defineVariable(global);
 
     if (isExport) {
-        emitBytes(OP_EXPORT, global);
+        emitBytes(OP_EXPORT, identifierConstant(&name));
     }
 }
 
@@ -764,6 +967,15 @@ static void returnStatement() {
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // `return f(...)`: nothing is left to do in this frame once the call
+        // is made, so the callee can take it over. The OP_RETURN stays for
+        // jumps that land past the call, as in `return a and f()`, and for
+        // natives, which return straight to this frame.
+        if (current->lastCall != -1 &&
+            current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -861,6 +1073,11 @@ ObjFunction* compile(const char* source, ObjModule* module) {
     parser.lexer = &lexer;
     parser.module = module;
 
+    // Nothing has been scanned yet, so an error this early is at the start.
+    Token start = {TOKEN_EOF, source, 0, 1};
+    parser.current = start;
+    parser.previous = start;
+
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT, module);
 
@@ -874,5 +1091,32 @@ ObjFunction* compile(const char* source, ObjModule* module) {
     }
 
     ObjFunction* function = endCompiler();
+    parser.lexer = NULL;
     return parser.hadError ? NULL : function;
 }
+
+bool isCompiling() {
+    return parser.lexer != NULL;
+}
+
+void compilingError(const char* message) {
+    printErrorAt(&parser.previous, false, message);
+}
+
+void abandonCompilation() {
+    current = NULL;
+    parser.lexer = NULL;
+#ifdef FLS_SUPERINSTRUCTIONS
+    freeFusion();
+#endif
+    abandonRegisterCompilation();
+}
+
+// Marks the functions still being compiled, which nothing else refers to yet.
+void markCompilerRoots() {
+    Compiler* compiler = current;
+    while (compiler != NULL) {
+        markObject((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 // Disassembles all instructions in a chunk.
 void disassembleChunk(Chunk* chunk, const char* name) {
@@ -35,6 +37,18 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; 
 }
 
+// Prints a global slot instruction along with the variable's name.
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm.globalNames.count) {
+        printValue(vm.globalNames.values[slot]);
+    }
+    printf("'\n");
+    return offset + 3;
+}
+
 // Prints a jump instruction.
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -44,13 +58,62 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+// Prints an instruction whose operands are described by 'operands', one
+// character each: 'r' a slot or register, 'k' a constant, 'n' an argument
+// count, 'g' a two-byte global slot, and 'j' or 'b' a two-byte forward or
+// backward jump. Used for superinstructions and register code.
+static int operandInstruction(const char* name, const char* operands,
+                              Chunk* chunk, int offset) {
+    int length = 1;
+    for (const char* operand = operands; *operand != '\0'; operand++) {
+        length += (*operand == 'g' || *operand == 'j' || *operand == 'b') ? 2 : 1;
+    }
+
+    printf("%-16s", name);
+    int at = offset + 1;
+    for (const char* operand = operands; *operand != '\0'; operand++) {
+        switch (*operand) {
+            case 'k':
+                printf(" %4d '", chunk->code[at]);
+                printValue(chunk->constants.values[chunk->code[at]]);
+                printf("'");
+                at++;
+                break;
+            case 'g': {
+                uint16_t slot = (uint16_t)((chunk->code[at] << 8) | chunk->code[at + 1]);
+                printf(" %4d '", slot);
+                if (slot < vm.globalNames.count) {
+                    printValue(vm.globalNames.values[slot]);
+                }
+                printf("'");
+                at += 2;
+                break;
+            }
+            case 'j':
+            case 'b': {
+                uint16_t jump = (uint16_t)((chunk->code[at] << 8) | chunk->code[at + 1]);
+                printf(" -> %d", offset + length + (*operand == 'j' ? jump : -jump));
+                at += 2;
+                break;
+            }
+            default:
+                printf(" %4d", chunk->code[at]);
+                at++;
+                break;
+        }
+    }
+    printf("\n");
+    return offset + length;
+}
+
 // Disassembles a single instruction.
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -75,6 +138,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_SLOT:
+            return globalInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+        case OP_DEFINE_GLOBAL_SLOT:
+            return globalInstruction("OP_DEFINE_GLOBAL_SLOT", chunk, offset);
+        case OP_SET_GLOBAL_SLOT:
+            return globalInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -104,10 +173,322 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_PRINT:
+            return simpleInstruction("OP_PRINT", offset);
+        case OP_NEW_LIST:
+            return simpleInstruction("OP_NEW_LIST", offset);
+        case OP_LIST_APPEND:
+            return simpleInstruction("OP_LIST_APPEND", offset);
+        case OP_GET_SUBSCRIPT:
+            return simpleInstruction("OP_GET_SUBSCRIPT", offset);
+        case OP_SET_SUBSCRIPT:
+            return simpleInstruction("OP_SET_SUBSCRIPT", offset);
+        case OP_IMPORT:
+            return simpleInstruction("OP_IMPORT", offset);
+        case OP_EXPORT:
+            return constantInstruction("OP_EXPORT", chunk, offset);
+        case OP_EXPORT_VAR:
+            return constantInstruction("OP_EXPORT_VAR", chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_GET_SUBSCRIPT_LIST_NUM:
+            return simpleInstruction("OP_GET_SUBSCRIPT_LIST_NUM", offset);
+        case OP_SET_SUBSCRIPT_LIST_NUM:
+            return simpleInstruction("OP_SET_SUBSCRIPT_LIST_NUM", offset);
+        case OP_LESS_LOCALS_JUMP:
+            return operandInstruction("OP_LESS_LOCALS_JUMP", "rrj", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return operandInstruction("OP_LESS_LOCAL_CONSTANT_JUMP", "rkj", chunk, offset);
+        case OP_ADD_LOCALS:
+            return operandInstruction("OP_ADD_LOCALS", "rr", chunk, offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return operandInstruction("OP_ADD_LOCAL_CONSTANT", "rk", chunk, offset);
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            return operandInstruction("OP_SUBTRACT_LOCAL_CONSTANT", "rk", chunk, offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_CONSTANT_CALL:
+            return operandInstruction("OP_CONSTANT_CALL", "kn", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_JUMP_IF_FALSE_OR_POP:
+            return jumpInstruction("OP_JUMP_IF_FALSE_OR_POP", 1, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+// Opcode names, indexed by opcode.
+static const char* opcodeNames[UINT8_COUNT] = {
+    [OP_CONSTANT]                 = "OP_CONSTANT",
+    [OP_NIL]                      = "OP_NIL",
+    [OP_TRUE]                     = "OP_TRUE",
+    [OP_FALSE]                    = "OP_FALSE",
+    [OP_POP]                      = "OP_POP",
+    [OP_GET_LOCAL]                = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]                = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL]               = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL]            = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL]               = "OP_SET_GLOBAL",
+    [OP_GET_GLOBAL_SLOT]          = "OP_GET_GLOBAL_SLOT",
+    [OP_DEFINE_GLOBAL_SLOT]       = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT]          = "OP_SET_GLOBAL_SLOT",
+    [OP_GET_PROPERTY]             = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY]             = "OP_SET_PROPERTY",
+    [OP_EXPORT_VAR]               = "OP_EXPORT_VAR",
+    [OP_EQUAL]                    = "OP_EQUAL",
+    [OP_GREATER]                  = "OP_GREATER",
+    [OP_LESS]                     = "OP_LESS",
+    [OP_ADD]                      = "OP_ADD",
+    [OP_SUBTRACT]                 = "OP_SUBTRACT",
+    [OP_MULTIPLY]                 = "OP_MULTIPLY",
+    [OP_DIVIDE]                   = "OP_DIVIDE",
+    [OP_MODULO]                   = "OP_MODULO",
+    [OP_NOT]                      = "OP_NOT",
+    [OP_NEGATE]                   = "OP_NEGATE",
+    [OP_PRINT]                    = "OP_PRINT",
+    [OP_JUMP]                     = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]            = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]                     = "OP_LOOP",
+    [OP_CALL]                     = "OP_CALL",
+    [OP_TAIL_CALL]                = "OP_TAIL_CALL",
+    [OP_NEW_LIST]                 = "OP_NEW_LIST",
+    [OP_LIST_APPEND]              = "OP_LIST_APPEND",
+    [OP_GET_SUBSCRIPT]            = "OP_GET_SUBSCRIPT",
+    [OP_SET_SUBSCRIPT]            = "OP_SET_SUBSCRIPT",
+    [OP_RETURN]                   = "OP_RETURN",
+    [OP_IMPORT]                   = "OP_IMPORT",
+    [OP_EXPORT]                   = "OP_EXPORT",
+    [OP_ADD_NUM]                  = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM]             = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM]             = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM]               = "OP_DIVIDE_NUM",
+    [OP_GREATER_NUM]              = "OP_GREATER_NUM",
+    [OP_LESS_NUM]                 = "OP_LESS_NUM",
+    [OP_GET_SUBSCRIPT_LIST_NUM]   = "OP_GET_SUBSCRIPT_LIST_NUM",
+    [OP_SET_SUBSCRIPT_LIST_NUM]   = "OP_SET_SUBSCRIPT_LIST_NUM",
+    [OP_LESS_LOCALS_JUMP]         = "OP_LESS_LOCALS_JUMP",
+    [OP_LESS_LOCAL_CONSTANT_JUMP] = "OP_LESS_LOCAL_CONSTANT_JUMP",
+    [OP_ADD_LOCALS]               = "OP_ADD_LOCALS",
+    [OP_ADD_LOCAL_CONSTANT]       = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT]  = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_NOT_EQUAL]                = "OP_NOT_EQUAL",
+    [OP_CONSTANT_CALL]            = "OP_CONSTANT_CALL",
+    [OP_SET_LOCAL_POP]            = "OP_SET_LOCAL_POP",
+    [OP_JUMP_IF_FALSE_OR_POP]     = "OP_JUMP_IF_FALSE_OR_POP",
+};
+
+// Returns the name of an opcode.
+const char* opcodeName(uint8_t opcode) {
+    return opcodeNames[opcode] != NULL ? opcodeNames[opcode] : "OP_UNKNOWN";
+}
+
+#ifdef DEBUG_PROFILE_OPCODES
+
+// Sequences longer than this are not tracked.
+#define PROFILE_MAX_LENGTH 4
+#define PROFILE_TABLE_SIZE 16384
+
+// An executed opcode sequence, packed one opcode per byte with the length in
+// the top byte, and how often it ran.
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+} SequenceCount;
+
+static uint64_t instructionCount = 0;
+static SequenceCount sequenceCounts[PROFILE_TABLE_SIZE];
+static int sequenceTotal = 0;
+static uint8_t history[PROFILE_MAX_LENGTH];
+static int historyLength = 0;
+
+// Maps a quickened opcode back to the instruction the compiler emitted, so
+// the profile describes sequences the compiler can actually fuse.
+static uint8_t emittedOpcode(uint8_t opcode) {
+    switch (opcode) {
+        case OP_ADD_NUM:                return OP_ADD;
+        case OP_SUBTRACT_NUM:           return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM:           return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:             return OP_DIVIDE;
+        case OP_GREATER_NUM:            return OP_GREATER;
+        case OP_LESS_NUM:               return OP_LESS;
+        case OP_GET_SUBSCRIPT_LIST_NUM: return OP_GET_SUBSCRIPT;
+        case OP_SET_SUBSCRIPT_LIST_NUM: return OP_SET_SUBSCRIPT;
+        default:                        return opcode;
+    }
+}
+
+// Adds one to the count of a packed sequence.
+static void countSequence(uint64_t key) {
+    uint32_t index = (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 50);
+    for (;;) {
+        SequenceCount* entry = &sequenceCounts[index];
+        if (entry->key == key) {
+            entry->count++;
+            return;
+        }
+        if (entry->key == 0) {
+            // Keep probe chains short; sequences this rare do not matter.
+            if (sequenceTotal >= PROFILE_TABLE_SIZE * 3 / 4) return;
+            sequenceTotal++;
+            entry->key = key;
+            entry->count = 1;
+            return;
+        }
+        index = (index + 1) & (PROFILE_TABLE_SIZE - 1);
+    }
+}
+
+// Records an opcode along with every sequence it ends.
+void profileOpcode(uint8_t opcode) {
+    instructionCount++;
+
+    if (historyLength == PROFILE_MAX_LENGTH) {
+        for (int i = 1; i < PROFILE_MAX_LENGTH; i++) {
+            history[i - 1] = history[i];
+        }
+        historyLength--;
+    }
+    history[historyLength++] = emittedOpcode(opcode);
+
+    uint64_t key = 0;
+    for (int length = 1; length <= historyLength; length++) {
+        key |= (uint64_t)history[historyLength - length] << (8 * (length - 1));
+        if (length >= 2) {
+            countSequence(key | ((uint64_t)length << 56));
+        }
+    }
+}
+
+// Orders sequences by descending count.
+static int compareSequences(const void* a, const void* b) {
+    uint64_t countA = ((const SequenceCount*)a)->count;
+    uint64_t countB = ((const SequenceCount*)b)->count;
+    if (countA == countB) return 0;
+    return countA < countB ? 1 : -1;
+}
+
+// Prints the hottest sequences of each length.
+void printOpcodeProfile() {
+    qsort(sequenceCounts, PROFILE_TABLE_SIZE, sizeof(SequenceCount),
+          compareSequences);
+
+    fprintf(stderr, "== opcode profile: %llu instructions ==\n",
+            (unsigned long long)instructionCount);
+    if (instructionCount == 0) return;
+
+    for (int length = 2; length <= PROFILE_MAX_LENGTH; length++) {
+        fprintf(stderr, "-- %d-instruction sequences --\n", length);
+        int printed = 0;
+        for (int i = 0; i < PROFILE_TABLE_SIZE && printed < 12; i++) {
+            SequenceCount* entry = &sequenceCounts[i];
+            if (entry->count == 0) break;
+            if ((int)(entry->key >> 56) != length) continue;
+
+            fprintf(stderr, "%6.2f%% %12llu ",
+                    100.0 * (double)entry->count / (double)instructionCount,
+                    (unsigned long long)entry->count);
+            for (int op = length - 1; op >= 0; op--) {
+                fprintf(stderr, " %s", opcodeName((uint8_t)(entry->key >> (8 * op))));
+            }
+            fprintf(stderr, "\n");
+            printed++;
+        }
+    }
+}
+
+#endif
+
+// Register instruction names and operand layouts, as for operandInstruction().
+typedef struct {
+    const char* name;
+    const char* operands;
+} RegisterInstruction;
+
+static const RegisterInstruction registerInstructions[] = {
+    [ROP_MOVE]              = {"MOVE", "rr"},
+    [ROP_LOADK]             = {"LOADK", "rk"},
+    [ROP_LOADNIL]           = {"LOADNIL", "r"},
+    [ROP_LOADTRUE]          = {"LOADTRUE", "r"},
+    [ROP_LOADFALSE]         = {"LOADFALSE", "r"},
+    [ROP_GET_GLOBAL]        = {"GET_GLOBAL", "rg"},
+    [ROP_SET_GLOBAL]        = {"SET_GLOBAL", "gr"},
+    [ROP_DEFINE_GLOBAL]     = {"DEFINE_GLOBAL", "gr"},
+    [ROP_ADD]               = {"ADD", "rrr"},
+    [ROP_ADDK]              = {"ADDK", "rrk"},
+    [ROP_SUBTRACT]          = {"SUBTRACT", "rrr"},
+    [ROP_SUBTRACTK]         = {"SUBTRACTK", "rrk"},
+    [ROP_MULTIPLY]          = {"MULTIPLY", "rrr"},
+    [ROP_MULTIPLYK]         = {"MULTIPLYK", "rrk"},
+    [ROP_DIVIDE]            = {"DIVIDE", "rrr"},
+    [ROP_DIVIDEK]           = {"DIVIDEK", "rrk"},
+    [ROP_MODULO]            = {"MODULO", "rrr"},
+    [ROP_MODULOK]           = {"MODULOK", "rrk"},
+    [ROP_EQUAL]             = {"EQUAL", "rrr"},
+    [ROP_EQUALK]            = {"EQUALK", "rrk"},
+    [ROP_LESS]              = {"LESS", "rrr"},
+    [ROP_LESSK]             = {"LESSK", "rrk"},
+    [ROP_GREATER]           = {"GREATER", "rrr"},
+    [ROP_GREATERK]          = {"GREATERK", "rrk"},
+    [ROP_NOT]               = {"NOT", "rr"},
+    [ROP_NEGATE]            = {"NEGATE", "rr"},
+    [ROP_JUMP]              = {"JUMP", "j"},
+    [ROP_JUMP_IF_FALSE]     = {"JUMP_IF_FALSE", "rj"},
+    [ROP_JUMP_IF_NOT_LESS]  = {"JUMP_IF_NOT_LESS", "rrj"},
+    [ROP_JUMP_IF_NOT_LESSK] = {"JUMP_IF_NOT_LESSK", "rkj"},
+    [ROP_LOOP]              = {"LOOP", "b"},
+    [ROP_CALL]              = {"CALL", "rn"},
+    [ROP_TAIL_CALL]         = {"TAIL_CALL", "rn"},
+    [ROP_RETURN]            = {"RETURN", "r"},
+    [ROP_NEW_LIST]          = {"NEW_LIST", "r"},
+    [ROP_LIST_APPEND]       = {"LIST_APPEND", "rr"},
+    [ROP_GET_SUBSCRIPT]     = {"GET_SUBSCRIPT", "rrr"},
+    [ROP_SET_SUBSCRIPT]     = {"SET_SUBSCRIPT", "rrrr"},
+    [ROP_IMPORT]            = {"IMPORT", "r"},
+    [ROP_EXPORT]            = {"EXPORT", "rk"},
+};
+
+// Disassembles a function compiled by the register backend.
+void disassembleRegisterChunk(Chunk* chunk, const char* name) {
+    printf("== %s (registers) ==\n", name);
+
+    for (int offset = 0; offset < chunk->count;) {
+        offset = disassembleRegisterInstruction(chunk, offset);
+    }
+}
+
+// Disassembles a single register instruction.
+int disassembleRegisterInstruction(Chunk* chunk, int offset) {
+    printf("%04d ", offset);
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
+        printf("   | ");
+    } else {
+        printf("%4d ", line);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    int count = sizeof(registerInstructions) / sizeof(registerInstructions[0]);
+    if (instruction >= count) {
+        printf("Unknown opcode %d\n", instruction);
+        return offset + 1;
+    }
+    return operandInstruction(registerInstructions[instruction].name,
+                              registerInstructions[instruction].operands,
+                              chunk, offset);
+}
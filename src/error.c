@@ -36,7 +36,7 @@ void runtimeError(const char* format, ...) {
     CallFrame* frame = &vm.frames[vm.frameCount - 1];
     ObjFunction* function = frame->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    int line = function->chunk.lines[instruction];
+    int line = getLine(&function->chunk, (int)instruction);
 
     // Open the source file to get the line content
     FILE* file = fopen(function->module->name->chars, "r");
@@ -67,7 +67,7 @@ void runtimeError(const char* format, ...) {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -75,5 +75,8 @@ void runtimeError(const char* format, ...) {
         }
     }
 
+    // Natives report errors by returning after this, so the caller has to
+    // be told to stop.
+    vm.hadError = true;
     resetStack();
 }
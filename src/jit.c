@@ -0,0 +1,854 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "jit.h"
+
+#ifdef FLS_JIT
+
+#include "chunk.h"
+#include "memory.h"
+
+// A baseline JIT: every bytecode instruction becomes a fixed template of
+// x86-64 code working on the same value stack and frame slots as the
+// interpreter, so a frame can switch between the two at any instruction
+// boundary. Templates cover what needs no help from the runtime: numbers,
+// booleans, locals, global slots, jumps and list indexing. Every other
+// instruction, and any template whose type or bounds guard fails, leaves
+// native code at the start of the instruction for the interpreter to run.
+// Runtime errors are therefore always raised by the interpreter, with the
+// line of the instruction that failed.
+//
+// Calls from native code to a function that has native code too push the
+// CallFrame and jump straight into the callee, and returns to a caller with
+// native code jump straight back, so recursion stays out of the interpreter
+// once everything involved is hot.
+//
+// Registers while native code runs:
+//   rbp  the current CallFrame
+//   rbx  frame->slots
+//   r12  the value stack top
+//   r13  &vm.stackTop, written back on exit
+//   r14  QNAN, for number checks
+//   r15  QNAN | SIGN_BIT, for object checks
+// rax, rcx, rdx, xmm0 and xmm1 are scratch within a template.
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Condition codes for Jcc and SETcc.
+enum {
+  CC_AE = 0x3,
+  CC_E  = 0x4,
+  CC_NE = 0x5,
+  CC_A  = 0x7,
+  CC_P  = 0xa,
+  CC_NP = 0xb,
+};
+
+// Scalar double instructions, encoded as F2 0F <op>.
+enum {
+  SSE_ADD = 0x58,
+  SSE_MUL = 0x59,
+  SSE_SUB = 0x5c,
+  SSE_DIV = 0x5e,
+};
+
+typedef enum {
+  COMPARE_LESS,
+  COMPARE_GREATER,
+} Comparison;
+
+// Where an instruction's operand comes from.
+typedef enum {
+  FROM_STACK,     // 'index' values below the stack top, 1 being the top.
+  FROM_SLOT,      // Frame slot 'index'.
+  FROM_CONSTANT,  // Constant 'index'.
+} OperandSource;
+
+typedef struct {
+  OperandSource source;
+  int index;
+} Operand;
+
+// A rel32 to fill in once the native offset of its target is known.
+typedef struct {
+  int position;  // Native offset of the rel32.
+  int target;    // Bytecode offset it branches to.
+} Patch;
+
+typedef struct {
+  Chunk* chunk;
+  uint8_t* code;
+  int count;
+  int capacity;
+  uint32_t* entries;
+  Patch* jumps;     // Branches to other instructions.
+  int jumpCount;
+  int jumpCapacity;
+  Patch* exits;     // Branches back to the interpreter.
+  int exitCount;
+  int exitCapacity;
+  int offset;       // Bytecode offset of the instruction being compiled.
+} Assembler;
+
+typedef uint32_t (*JitEntry)(CallFrame* frame, Value** stackTop,
+                             uint8_t* start);
+
+static void emitByte(Assembler* as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    int oldCapacity = as->capacity;
+    as->capacity = GROW_CAPACITY(oldCapacity);
+    as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emitSequence(Assembler* as, const uint8_t* bytes, int count) {
+  for (int i = 0; i < count; i++) emitByte(as, bytes[i]);
+}
+
+#define EMIT(as, ...)                                                      \
+  emitSequence(as, (const uint8_t[]){__VA_ARGS__},                        \
+               sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler* as, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Assembler* as, int position, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    as->code[position + i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static void addPatch(Patch** patches, int* count, int* capacity,
+                     int position, int target) {
+  if (*count == *capacity) {
+    int oldCapacity = *capacity;
+    *capacity = GROW_CAPACITY(oldCapacity);
+    *patches = GROW_ARRAY(Patch, *patches, oldCapacity, *capacity);
+  }
+  (*patches)[*count].position = position;
+  (*patches)[*count].target = target;
+  (*count)++;
+}
+
+// <opcode> reg, [base + disp] with a 64-bit operand size.
+static void emitMemory(Assembler* as, uint8_t opcode, int reg, int base,
+                       int32_t disp) {
+  emitByte(as, 0x48 | ((reg & 8) >> 1) | ((base & 8) >> 3));
+  emitByte(as, opcode);
+  emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emitByte(as, 0x24);
+  emit32(as, (uint32_t)disp);
+}
+
+// <opcode> dst, src for the r/m64, r64 forms (mov, add, or, and, xor, cmp).
+static void emitRegisters(Assembler* as, uint8_t opcode, int dst, int src) {
+  emitByte(as, 0x48 | ((src & 8) >> 1) | ((dst & 8) >> 3));
+  emitByte(as, opcode);
+  emitByte(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emitLoadImmediate(Assembler* as, int reg, uint64_t value) {
+  emitByte(as, 0x48 | ((reg & 8) >> 3));
+  emitByte(as, 0xb8 + (reg & 7));
+  emit64(as, value);
+}
+
+// Moves the stack top by 'slots' values.
+static void emitAdjustStack(Assembler* as, int slots) {
+  if (slots == 0) return;
+  // add/sub r12, imm8
+  EMIT(as, 0x49, 0x83, slots > 0 ? 0xc4 : 0xec, (uint8_t)(8 * abs(slots)));
+}
+
+static void emitLoadStack(Assembler* as, int reg, int depth) {
+  emitMemory(as, 0x8b, reg, R12, -8 * depth);
+}
+
+static void emitStoreStack(Assembler* as, int reg, int depth) {
+  emitMemory(as, 0x89, reg, R12, -8 * depth);
+}
+
+static void emitPush(Assembler* as, int reg) {
+  emitStoreStack(as, reg, 0);
+  emitAdjustStack(as, 1);
+}
+
+static void emitLoadOperand(Assembler* as, int reg, Operand operand) {
+  switch (operand.source) {
+    case FROM_STACK:
+      emitLoadStack(as, reg, operand.index);
+      break;
+    case FROM_SLOT:
+      emitMemory(as, 0x8b, reg, RBX, 8 * operand.index);
+      break;
+    case FROM_CONSTANT:
+      emitLoadImmediate(as, reg,
+                        as->chunk->constants.values[operand.index]);
+      break;
+  }
+}
+
+// Leaves for the interpreter at the current instruction when 'cc' holds.
+static void emitExitIf(Assembler* as, int cc) {
+  EMIT(as, 0x0f, 0x80 | cc);
+  addPatch(&as->exits, &as->exitCount, &as->exitCapacity, as->count,
+           as->offset);
+  emit32(as, 0);
+}
+
+// Leaves the whole instruction to the interpreter.
+static void emitExit(Assembler* as) {
+  emitByte(as, 0xe9);
+  addPatch(&as->exits, &as->exitCount, &as->exitCapacity, as->count,
+           as->offset);
+  emit32(as, 0);
+}
+
+static void addJump(Assembler* as, int position, int target) {
+  addPatch(&as->jumps, &as->jumpCount, &as->jumpCapacity, position, target);
+}
+
+static void emitJump(Assembler* as, int target) {
+  emitByte(as, 0xe9);
+  addJump(as, as->count, target);
+  emit32(as, 0);
+}
+
+// Emits a forward Jcc within the current template and returns the position
+// of its rel32 for patchForward().
+static int emitForward(Assembler* as, int cc) {
+  EMIT(as, 0x0f, 0x80 | cc);
+  emit32(as, 0);
+  return as->count - 4;
+}
+
+static void patchForward(Assembler* as, int position) {
+  patch32(as, position, (uint32_t)(as->count - (position + 4)));
+}
+
+// cmp dword [base + disp], imm32, for a base of rax or rcx.
+static void emitCompareMemory32(Assembler* as, int base, int32_t disp,
+                                uint32_t value) {
+  EMIT(as, 0x81, 0xb8 | base);
+  emit32(as, (uint32_t)disp);
+  emit32(as, value);
+}
+
+// reg & QNAN == QNAN means reg is not a number.
+static void emitIsNotNumber(Assembler* as, int reg) {
+  emitRegisters(as, 0x89, RCX, reg);
+  emitRegisters(as, 0x21, RCX, R14);
+  emitRegisters(as, 0x39, RCX, R14);
+}
+
+static bool isNumberConstant(Assembler* as, Operand operand) {
+  return operand.source == FROM_CONSTANT &&
+         IS_NUMBER(as->chunk->constants.values[operand.index]);
+}
+
+// Loads two numeric operands into rax/xmm0 and rdx/xmm1, leaving for the
+// interpreter if either is not a number.
+static void emitLoadNumbers(Assembler* as, Operand a, Operand b) {
+  emitLoadOperand(as, RAX, a);
+  emitLoadOperand(as, RDX, b);
+  if (!isNumberConstant(as, a)) {
+    emitIsNotNumber(as, RAX);
+    emitExitIf(as, CC_E);
+  }
+  if (!isNumberConstant(as, b)) {
+    emitIsNotNumber(as, RDX);
+    emitExitIf(as, CC_E);
+  }
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0);  // movq xmm0, rax
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xca);  // movq xmm1, rdx
+}
+
+// Stores rax as the result of an instruction that consumed 'popped' stack
+// values.
+static void emitResult(Assembler* as, int popped) {
+  emitStoreStack(as, RAX, popped);
+  emitAdjustStack(as, 1 - popped);
+}
+
+static void emitArithmetic(Assembler* as, uint8_t sseOp, Operand a,
+                           Operand b, int popped) {
+  emitLoadNumbers(as, a, b);
+  EMIT(as, 0xf2, 0x0f, sseOp, 0xc1);       // <op>sd xmm0, xmm1
+  EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);  // movq rax, xmm0
+  emitResult(as, popped);
+}
+
+// Turns the 0 or 1 in al into FALSE_VAL or TRUE_VAL in rax.
+static void emitBoolFromFlag(Assembler* as) {
+  EMIT(as, 0x0f, 0xb6, 0xc0);  // movzx eax, al
+  emitLoadImmediate(as, RCX, FALSE_VAL);
+  emitRegisters(as, 0x09, RAX, RCX);
+}
+
+static void emitCompare(Assembler* as, Comparison comparison, Operand a,
+                        Operand b, int popped) {
+  emitLoadNumbers(as, a, b);
+  switch (comparison) {
+    case COMPARE_LESS:
+      // b > a is false when either is NaN, like a < b.
+      EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+      EMIT(as, 0x0f, 0x90 | CC_A, 0xc0);
+      break;
+    case COMPARE_GREATER:
+      EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+      EMIT(as, 0x0f, 0x90 | CC_A, 0xc0);
+      break;
+  }
+  emitBoolFromFlag(as);
+  emitResult(as, popped);
+}
+
+// Leaves for the interpreter if 'reg' holds a rope or a string too long to
+// be interned, which can equal another object with the same characters.
+static void emitExitIfLongString(Assembler* as, int reg) {
+  emitRegisters(as, 0x89, RCX, reg);
+  emitRegisters(as, 0x21, RCX, R15);
+  emitRegisters(as, 0x39, RCX, R15);
+  int notObject = emitForward(as, CC_NE);
+  emitRegisters(as, 0x89, RCX, reg);
+  emitRegisters(as, 0x31, RCX, R15);
+  emitCompareMemory32(as, RCX, offsetof(Obj, type), OBJ_ROPE);
+  emitExitIf(as, CC_E);
+  emitCompareMemory32(as, RCX, offsetof(Obj, type), OBJ_STRING);
+  int notString = emitForward(as, CC_NE);
+  emitCompareMemory32(as, RCX, offsetof(ObjString, length), STRING_INTERN_MAX);
+  emitExitIf(as, CC_A);
+  patchForward(as, notObject);
+  patchForward(as, notString);
+}
+
+// Equality follows valuesEqual(): two numbers compare as doubles, anything
+// else compares bits, unless a long string is involved. An interned string
+// never has the same characters as a long one, so checking one side is
+// enough.
+static void emitEquality(Assembler* as, bool negate) {
+  emitLoadStack(as, RAX, 2);
+  emitLoadStack(as, RDX, 1);
+  emitIsNotNumber(as, RAX);
+  int aNotNumber = emitForward(as, CC_E);
+  emitIsNotNumber(as, RDX);
+  int bNotNumber = emitForward(as, CC_E);
+
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0);  // movq xmm0, rax
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xca);  // movq xmm1, rdx
+  EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);        // ucomisd xmm0, xmm1
+  if (negate) {
+    EMIT(as, 0x0f, 0x90 | CC_NE, 0xc0);    // setne al
+    EMIT(as, 0x0f, 0x90 | CC_P, 0xc1);     // setp cl
+    EMIT(as, 0x08, 0xc8);                  // or al, cl
+  } else {
+    EMIT(as, 0x0f, 0x90 | CC_E, 0xc0);     // sete al
+    EMIT(as, 0x0f, 0x90 | CC_NP, 0xc1);    // setnp cl
+    EMIT(as, 0x20, 0xc8);                  // and al, cl
+  }
+  EMIT(as, 0xeb, 0x00);                    // jmp done
+  int skip = as->count - 1;
+
+  patchForward(as, aNotNumber);
+  patchForward(as, bNotNumber);
+  emitRegisters(as, 0x39, RAX, RDX);
+  int same = emitForward(as, CC_E);
+  emitExitIfLongString(as, RAX);
+  emitRegisters(as, 0x39, RAX, RDX);
+  patchForward(as, same);
+  EMIT(as, 0x0f, 0x90 | (negate ? CC_NE : CC_E), 0xc0);
+
+  as->code[skip] = (uint8_t)(as->count - (skip + 1));
+  emitBoolFromFlag(as);
+  emitResult(as, 2);
+}
+
+// Emits branches taken when 'reg' is falsey (nil, false or zero) and stores
+// the positions of their rel32s in 'branches'.
+static void emitFalseyBranches(Assembler* as, int reg, int branches[3]) {
+  emitLoadImmediate(as, RCX, NIL_VAL);
+  emitRegisters(as, 0x39, reg, RCX);
+  branches[0] = emitForward(as, CC_E);
+  emitLoadImmediate(as, RCX, FALSE_VAL);
+  emitRegisters(as, 0x39, reg, RCX);
+  branches[1] = emitForward(as, CC_E);
+  // Only 0.0 and -0.0 are zero once the sign bit is shifted out.
+  emitRegisters(as, 0x89, RCX, reg);
+  emitRegisters(as, 0x01, RCX, RCX);
+  branches[2] = emitForward(as, CC_E);
+}
+
+static void emitJumpIfFalsey(Assembler* as, int reg, int target) {
+  int branches[3];
+  emitFalseyBranches(as, reg, branches);
+  for (int i = 0; i < 3; i++) addJump(as, branches[i], target);
+}
+
+// Less-than test of a fused `a < b; JUMP_IF_FALSE; POP`: falls through when
+// it holds and otherwise pushes false for the POP at the target.
+static void emitLessJump(Assembler* as, Operand a, Operand b, int target) {
+  emitLoadNumbers(as, a, b);
+  EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+  int taken = emitForward(as, CC_A);
+  emitLoadImmediate(as, RAX, FALSE_VAL);
+  emitPush(as, RAX);
+  emitJump(as, target);
+  patchForward(as, taken);
+}
+
+// With the list value in rax and the index value in rdx, leaves the list's
+// values array in rax and the element index in rdx, or leaves for the
+// interpreter if rax is not a list or the index is not a number in bounds.
+static void emitListElement(Assembler* as) {
+  emitIsNotNumber(as, RDX);
+  emitExitIf(as, CC_E);
+  emitRegisters(as, 0x89, RCX, RAX);
+  emitRegisters(as, 0x21, RCX, R15);
+  emitRegisters(as, 0x39, RCX, R15);
+  emitExitIf(as, CC_NE);
+  emitRegisters(as, 0x31, RAX, R15);  // Strip the tag to get the Obj*.
+  emitCompareMemory32(as, RAX, offsetof(Obj, type), OBJ_LIST);
+  emitExitIf(as, CC_NE);
+
+  EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc2);  // movq xmm0, rdx
+  EMIT(as, 0xf2, 0x48, 0x0f, 0x2c, 0xd0);  // cvttsd2si rdx, xmm0
+  emitMemory(as, 0x63, RCX, RAX, offsetof(ObjList, items.count));  // movsxd
+  // Negative indexes count from the end.
+  EMIT(as, 0x48, 0x85, 0xd2);              // test rdx, rdx
+  EMIT(as, 0x79, 0x03);                    // jns +3
+  emitRegisters(as, 0x01, RDX, RCX);
+  emitRegisters(as, 0x39, RDX, RCX);
+  emitExitIf(as, CC_AE);
+  emitMemory(as, 0x8b, RAX, RAX, offsetof(ObjList, items.values));
+}
+
+// cmp byte [reg + isMarked], 0, for a reg below rsp or rsi/rdi. Outside a
+// collection an object is marked exactly when it is old.
+static void emitCompareMarked(Assembler* as, int reg) {
+  EMIT(as, 0x80, 0x78 | reg, offsetof(Obj, isMarked), 0x00);
+}
+
+// Leaves for the interpreter, which runs the write barrier, when the value
+// in rcx is a young object about to be stored into the old list 3 values
+// below the stack top.
+static void emitExitIfBarrier(Assembler* as) {
+  emitRegisters(as, 0x89, RSI, RCX);
+  emitRegisters(as, 0x21, RSI, R15);
+  emitRegisters(as, 0x39, RSI, R15);
+  int notObject = emitForward(as, CC_NE);
+  emitRegisters(as, 0x89, RSI, RCX);
+  emitRegisters(as, 0x31, RSI, R15);
+  emitCompareMarked(as, RSI);
+  int valueOld = emitForward(as, CC_NE);
+  emitLoadStack(as, RSI, 3);
+  emitRegisters(as, 0x31, RSI, R15);
+  emitCompareMarked(as, RSI);
+  emitExitIf(as, CC_NE);
+  patchForward(as, notObject);
+  patchForward(as, valueOld);
+}
+
+// Calls the function 'argCount' values below the stack top after pushing
+// 'constant', if there is one, as the last argument. Only calls to a
+// function with native code and the right arity are made here; every other
+// call, and the stack overflow check failing, goes through the interpreter.
+static void emitCall(Assembler* as, int argCount, const Operand* constant) {
+  int calleeDepth = argCount + 1 - (constant != NULL ? 1 : 0);
+  emitLoadStack(as, RAX, calleeDepth);
+  emitRegisters(as, 0x89, RCX, RAX);
+  emitRegisters(as, 0x21, RCX, R15);
+  emitRegisters(as, 0x39, RCX, R15);
+  emitExitIf(as, CC_NE);
+  emitRegisters(as, 0x31, RAX, R15);
+  emitCompareMemory32(as, RAX, offsetof(Obj, type), OBJ_FUNCTION);
+  emitExitIf(as, CC_NE);
+  emitCompareMemory32(as, RAX, offsetof(ObjFunction, arity), argCount);
+  emitExitIf(as, CC_NE);
+  emitMemory(as, 0x8b, RDX, RAX, offsetof(ObjFunction, jit));
+  EMIT(as, 0x48, 0x85, 0xd2);  // test rdx, rdx
+  emitExitIf(as, CC_E);
+  emitLoadImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.frameCount);
+  emitCompareMemory32(as, RCX, 0, FRAMES_MAX);
+  emitExitIf(as, CC_AE);
+
+  if (constant != NULL) {
+    emitLoadOperand(as, RSI, *constant);
+    emitPush(as, RSI);
+  }
+  EMIT(as, 0xff, 0x81, 0, 0, 0, 0);  // inc dword [rcx]
+  uint8_t* ip = as->chunk->code + as->offset;
+  emitLoadImmediate(as, RSI, (uint64_t)(uintptr_t)(ip + 1 + operandBytes(*ip)));
+  emitMemory(as, 0x89, RSI, RBP, offsetof(CallFrame, ip));
+
+  emitMemory(as, 0x8d, RBP, RBP, sizeof(CallFrame));  // lea
+  emitMemory(as, 0x89, RAX, RBP, offsetof(CallFrame, function));
+  emitMemory(as, 0x8b, RSI, RAX, offsetof(ObjFunction, chunk.code));
+  emitMemory(as, 0x89, RSI, RBP, offsetof(CallFrame, ip));
+  emitMemory(as, 0x8d, RBX, R12, -8 * (argCount + 1));  // lea
+  emitMemory(as, 0x89, RBX, RBP, offsetof(CallFrame, slots));
+  emitMemory(as, 0x8b, RCX, RDX, offsetof(JitCode, start));
+  EMIT(as, 0xff, 0xe1);  // jmp rcx
+}
+
+// Returns to a caller with native code, resuming it where its frame's ip
+// points. Returning to an interpreted caller or from the outermost frame
+// goes through the interpreter.
+static void emitReturn(Assembler* as) {
+  emitLoadImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.frameCount);
+  emitCompareMemory32(as, RCX, 0, 1);
+  emitExitIf(as, CC_E);
+  emitMemory(as, 0x8b, RAX, RBP,
+             (int32_t)offsetof(CallFrame, function) - (int32_t)sizeof(CallFrame));
+  emitMemory(as, 0x8b, RDX, RAX, offsetof(ObjFunction, jit));
+  EMIT(as, 0x48, 0x85, 0xd2);  // test rdx, rdx
+  emitExitIf(as, CC_E);
+
+  emitLoadStack(as, RSI, 1);
+  emitRegisters(as, 0x89, R12, RBX);
+  emitPush(as, RSI);
+  EMIT(as, 0xff, 0x89, 0, 0, 0, 0);  // dec dword [rcx]
+  emitMemory(as, 0x8d, RBP, RBP, -(int32_t)sizeof(CallFrame));  // lea
+  emitMemory(as, 0x8b, RBX, RBP, offsetof(CallFrame, slots));
+  emitMemory(as, 0x8b, RCX, RBP, offsetof(CallFrame, ip));
+  emitMemory(as, 0x2b, RCX, RAX, offsetof(ObjFunction, chunk.code));  // sub
+  emitMemory(as, 0x8b, RSI, RDX, offsetof(JitCode, entries));
+  EMIT(as, 0x8b, 0x0c, 0x8e);  // mov ecx, [rsi + rcx*4]
+  emitMemory(as, 0x03, RCX, RDX, offsetof(JitCode, code));  // add
+  EMIT(as, 0xff, 0xe1);  // jmp rcx
+}
+
+static void emitGlobalValues(Assembler* as) {
+  emitLoadImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  emitMemory(as, 0x8b, RCX, RCX, 0);
+}
+
+// Leaves for the interpreter, which reports the error, if rax is undefined.
+static void emitExitIfUndefined(Assembler* as) {
+  emitLoadImmediate(as, RDX, UNDEFINED_VAL);
+  emitRegisters(as, 0x39, RAX, RDX);
+  emitExitIf(as, CC_E);
+}
+
+static void compileInstruction(Assembler* as) {
+  uint8_t* ip = as->chunk->code + as->offset;
+  Operand top = {FROM_STACK, 1};
+  Operand second = {FROM_STACK, 2};
+
+  switch (ip[0]) {
+    case OP_CONSTANT:
+      emitLoadOperand(as, RAX, (Operand){FROM_CONSTANT, ip[1]});
+      emitPush(as, RAX);
+      break;
+    case OP_NIL:
+      emitLoadImmediate(as, RAX, NIL_VAL);
+      emitPush(as, RAX);
+      break;
+    case OP_TRUE:
+      emitLoadImmediate(as, RAX, TRUE_VAL);
+      emitPush(as, RAX);
+      break;
+    case OP_FALSE:
+      emitLoadImmediate(as, RAX, FALSE_VAL);
+      emitPush(as, RAX);
+      break;
+    case OP_POP:
+      emitAdjustStack(as, -1);
+      break;
+    case OP_GET_LOCAL:
+      emitLoadOperand(as, RAX, (Operand){FROM_SLOT, ip[1]});
+      emitPush(as, RAX);
+      break;
+    case OP_SET_LOCAL:
+      emitLoadStack(as, RAX, 1);
+      emitMemory(as, 0x89, RAX, RBX, 8 * ip[1]);
+      break;
+    case OP_SET_LOCAL_POP:
+      emitLoadStack(as, RAX, 1);
+      emitAdjustStack(as, -1);
+      emitMemory(as, 0x89, RAX, RBX, 8 * ip[1]);
+      break;
+    case OP_GET_GLOBAL_SLOT: {
+      int slot = (ip[1] << 8) | ip[2];
+      emitGlobalValues(as);
+      emitMemory(as, 0x8b, RAX, RCX, 8 * slot);
+      emitExitIfUndefined(as);
+      emitPush(as, RAX);
+      break;
+    }
+    case OP_SET_GLOBAL_SLOT: {
+      int slot = (ip[1] << 8) | ip[2];
+      emitGlobalValues(as);
+      emitMemory(as, 0x8b, RAX, RCX, 8 * slot);
+      emitExitIfUndefined(as);
+      emitLoadStack(as, RAX, 1);
+      emitMemory(as, 0x89, RAX, RCX, 8 * slot);
+      break;
+    }
+    case OP_DEFINE_GLOBAL_SLOT: {
+      int slot = (ip[1] << 8) | ip[2];
+      emitGlobalValues(as);
+      emitLoadStack(as, RAX, 1);
+      emitAdjustStack(as, -1);
+      emitMemory(as, 0x89, RAX, RCX, 8 * slot);
+      break;
+    }
+    case OP_EQUAL:
+      emitEquality(as, false);
+      break;
+    case OP_NOT_EQUAL:
+      emitEquality(as, true);
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      emitCompare(as, COMPARE_GREATER, second, top, 2);
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      emitCompare(as, COMPARE_LESS, second, top, 2);
+      break;
+    // Strings fail the number guard and are concatenated by the interpreter.
+    case OP_ADD:
+    case OP_ADD_NUM:
+      emitArithmetic(as, SSE_ADD, second, top, 2);
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      emitArithmetic(as, SSE_SUB, second, top, 2);
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      emitArithmetic(as, SSE_MUL, second, top, 2);
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      emitArithmetic(as, SSE_DIV, second, top, 2);
+      break;
+    case OP_NOT: {
+      emitLoadStack(as, RAX, 1);
+      emitLoadImmediate(as, RDX, TRUE_VAL);
+      int branches[3];
+      emitFalseyBranches(as, RAX, branches);
+      emitLoadImmediate(as, RDX, FALSE_VAL);
+      for (int i = 0; i < 3; i++) patchForward(as, branches[i]);
+      emitStoreStack(as, RDX, 1);
+      break;
+    }
+    case OP_NEGATE:
+      emitLoadStack(as, RAX, 1);
+      emitIsNotNumber(as, RAX);
+      emitExitIf(as, CC_E);
+      emitLoadImmediate(as, RCX, SIGN_BIT);
+      emitRegisters(as, 0x31, RAX, RCX);
+      emitStoreStack(as, RAX, 1);
+      break;
+    case OP_JUMP:
+    case OP_LOOP:
+      emitJump(as, jumpTarget(as->chunk, as->offset));
+      break;
+    case OP_JUMP_IF_FALSE:
+      emitLoadStack(as, RAX, 1);
+      emitJumpIfFalsey(as, RAX, jumpTarget(as->chunk, as->offset));
+      break;
+    case OP_JUMP_IF_FALSE_OR_POP:
+      emitLoadStack(as, RAX, 1);
+      emitJumpIfFalsey(as, RAX, jumpTarget(as->chunk, as->offset));
+      emitAdjustStack(as, -1);
+      break;
+    case OP_GET_SUBSCRIPT:
+    case OP_GET_SUBSCRIPT_LIST_NUM:
+      emitLoadStack(as, RAX, 2);
+      emitLoadStack(as, RDX, 1);
+      emitListElement(as);
+      EMIT(as, 0x48, 0x8b, 0x04, 0xd0);  // mov rax, [rax + rdx*8]
+      emitResult(as, 2);
+      break;
+    case OP_SET_SUBSCRIPT:
+    case OP_SET_SUBSCRIPT_LIST_NUM:
+      emitLoadStack(as, RAX, 3);
+      emitLoadStack(as, RDX, 2);
+      emitListElement(as);
+      emitLoadStack(as, RCX, 1);
+      emitExitIfBarrier(as);
+      EMIT(as, 0x48, 0x89, 0x0c, 0xd0);  // mov [rax + rdx*8], rcx
+      emitStoreStack(as, RCX, 3);
+      emitAdjustStack(as, -2);
+      break;
+    case OP_LESS_LOCALS_JUMP:
+      emitLessJump(as, (Operand){FROM_SLOT, ip[1]},
+                   (Operand){FROM_SLOT, ip[2]},
+                   as->offset + 5 + ((ip[3] << 8) | ip[4]));
+      break;
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+      emitLessJump(as, (Operand){FROM_SLOT, ip[1]},
+                   (Operand){FROM_CONSTANT, ip[2]},
+                   as->offset + 5 + ((ip[3] << 8) | ip[4]));
+      break;
+    case OP_ADD_LOCALS:
+      emitArithmetic(as, SSE_ADD, (Operand){FROM_SLOT, ip[1]},
+                     (Operand){FROM_SLOT, ip[2]}, 0);
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+      emitArithmetic(as, SSE_ADD, (Operand){FROM_SLOT, ip[1]},
+                     (Operand){FROM_CONSTANT, ip[2]}, 0);
+      break;
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+      emitArithmetic(as, SSE_SUB, (Operand){FROM_SLOT, ip[1]},
+                     (Operand){FROM_CONSTANT, ip[2]}, 0);
+      break;
+    case OP_CALL:
+      emitCall(as, ip[1], NULL);
+      break;
+    case OP_CONSTANT_CALL: {
+      Operand constant = {FROM_CONSTANT, ip[1]};
+      emitCall(as, ip[2], &constant);
+      break;
+    }
+    case OP_RETURN:
+      emitReturn(as);
+      break;
+    default:
+      // Anything that allocates, prints or touches a table runs in the
+      // interpreter.
+      emitExit(as);
+      break;
+  }
+}
+
+// Saves the callee-saved registers the templates use, sets them up and
+// jumps to the native code of the instruction to start at.
+static void emitPrologue(Assembler* as) {
+  EMIT(as, 0x55);               // push rbp
+  EMIT(as, 0x53);               // push rbx
+  EMIT(as, 0x41, 0x54);         // push r12
+  EMIT(as, 0x41, 0x55);         // push r13
+  EMIT(as, 0x41, 0x56);         // push r14
+  EMIT(as, 0x41, 0x57);         // push r15
+  emitRegisters(as, 0x89, RBP, RDI);
+  emitMemory(as, 0x8b, RBX, RBP, offsetof(CallFrame, slots));
+  emitRegisters(as, 0x89, R13, RSI);
+  emitMemory(as, 0x8b, R12, R13, 0);
+  emitLoadImmediate(as, R14, QNAN);
+  emitLoadImmediate(as, R15, QNAN | SIGN_BIT);
+  EMIT(as, 0xff, 0xe2);         // jmp rdx
+}
+
+// Every exit loads the bytecode offset to resume at into eax and comes here.
+static void emitEpilogue(Assembler* as) {
+  emitMemory(as, 0x89, R12, R13, 0);
+  EMIT(as, 0x41, 0x5f);         // pop r15
+  EMIT(as, 0x41, 0x5e);         // pop r14
+  EMIT(as, 0x41, 0x5d);         // pop r13
+  EMIT(as, 0x41, 0x5c);         // pop r12
+  EMIT(as, 0x5b);               // pop rbx
+  EMIT(as, 0x5d);               // pop rbp
+  EMIT(as, 0xc3);               // ret
+}
+
+static void freeAssembler(Assembler* as) {
+  FREE_ARRAY(uint8_t, as->code, as->capacity);
+  FREE_ARRAY(Patch, as->jumps, as->jumpCapacity);
+  FREE_ARRAY(Patch, as->exits, as->exitCapacity);
+}
+
+bool jitCompile(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler as;
+  memset(&as, 0, sizeof(as));
+  as.chunk = chunk;
+  as.entries = ALLOCATE(uint32_t, chunk->count);
+
+  emitPrologue(&as);
+  for (int offset = 0; offset < chunk->count;
+       offset += 1 + operandBytes(chunk->code[offset])) {
+    as.offset = offset;
+    as.entries[offset] = as.count;
+    compileInstruction(&as);
+  }
+
+  for (int i = 0; i < as.jumpCount; i++) {
+    Patch* jump = &as.jumps[i];
+    patch32(&as, jump->position,
+            as.entries[jump->target] - (jump->position + 4));
+  }
+
+  int epilogue = as.count;
+  emitEpilogue(&as);
+
+  // Exits are recorded in bytecode order, so the ones leaving from the same
+  // instruction share a stub.
+  int stub = -1;
+  for (int i = 0; i < as.exitCount; i++) {
+    Patch* exit = &as.exits[i];
+    if (i == 0 || exit->target != as.exits[i - 1].target) {
+      stub = as.count;
+      emitByte(&as, 0xb8);  // mov eax, imm32
+      emit32(&as, (uint32_t)exit->target);
+      emitByte(&as, 0xe9);
+      emit32(&as, (uint32_t)(epilogue - (as.count + 4)));
+    }
+    patch32(&as, exit->position, (uint32_t)(stub - (exit->position + 4)));
+  }
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+  size_t size = ((size_t)as.count + pageSize - 1) & ~(size_t)(pageSize - 1);
+  uint8_t* code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    FREE_ARRAY(uint32_t, as.entries, chunk->count);
+    freeAssembler(&as);
+    return false;
+  }
+  memcpy(code, as.code, as.count);
+  if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(code, size);
+    FREE_ARRAY(uint32_t, as.entries, chunk->count);
+    freeAssembler(&as);
+    return false;
+  }
+
+  JitCode* jit = ALLOCATE(JitCode, 1);
+  jit->code = code;
+  jit->size = size;
+  jit->start = code + as.entries[0];
+  jit->entries = as.entries;
+  jit->entryCount = chunk->count;
+  function->jit = jit;
+  freeAssembler(&as);
+  return true;
+}
+
+void jitExecute(CallFrame* frame) {
+  JitCode* jit = frame->function->jit;
+  JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+  int start = (int)(frame->ip - frame->function->chunk.code);
+  uint32_t offset = entry(frame, &vm.stackTop,
+                          jit->code + jit->entries[start]);
+
+  // Native calls and returns may have left a different frame on top.
+  frame = &vm.frames[vm.frameCount - 1];
+  frame->ip = frame->function->chunk.code + offset;
+}
+
+void freeJitCode(ObjFunction* function) {
+  JitCode* jit = function->jit;
+  if (jit == NULL) return;
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(uint32_t, jit->entries, jit->entryCount);
+  FREE(JitCode, jit);
+  function->jit = NULL;
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "aot.h"
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
@@ -55,6 +56,15 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+// Writes a script, and the modules it imports, out as a C program.
+static void emitFile(const char* path) {
+    char* source = readFile(path);
+    bool emitted = emitC(path, source, stdout);
+    free(source);
+
+    if (!emitted) exit(65);
+}
+
 // Runs a script from a file.
 static void runFile(const char* path) {
     char* source = readFile(path);
@@ -65,16 +75,78 @@ static void runFile(const char* path) {
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// Reads a heap size such as 65536, 512K, 64M or 2G for 'setting'. 0 means
+// no limit.
+static size_t parseHeapSize(const char* setting, const char* text) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+    if (end == text || *end != '\0') {
+        fprintf(stderr, "Invalid size '%s' for %s. Use a number of bytes, "
+                        "optionally followed by K, M or G.\n", text, setting);
+        exit(64);
+    }
+    return (size_t)size;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: fls [--backend=stack|register] [--heap-limit=SIZE]\n"
+                    "           [--heap-soft-limit=SIZE] [path]\n"
+                    "       fls --emit-c path\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if (argc == 1) {
+    // The heap limits can come from the environment, so that they also
+    // apply to scripts started by other programs. Options override them.
+    const char* limit = getenv("FLS_HEAP_LIMIT");
+    if (limit != NULL) vm.hardLimit = parseHeapSize("FLS_HEAP_LIMIT", limit);
+    limit = getenv("FLS_HEAP_SOFT_LIMIT");
+    if (limit != NULL) vm.softLimit = parseHeapSize("FLS_HEAP_SOFT_LIMIT", limit);
+
+    int arg = 1;
+    bool emit = false;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        const char* option = argv[arg];
+        if (strcmp(option, "--emit-c") == 0) {
+            // The generated C runs plain stack bytecode, so skip fusion.
+            vm.backend = BACKEND_C;
+            emit = true;
+        } else if (strncmp(option, "--backend=", 10) == 0) {
+            const char* backend = option + 10;
+            if (strcmp(backend, "stack") == 0) {
+                vm.backend = BACKEND_STACK;
+            } else if (strcmp(backend, "register") == 0) {
+                vm.backend = BACKEND_REGISTER;
+            } else {
+                fprintf(stderr, "Unknown backend '%s'. Use 'stack' or 'register'.\n", backend);
+                exit(64);
+            }
+        } else if (strncmp(option, "--heap-limit=", 13) == 0) {
+            vm.hardLimit = parseHeapSize("--heap-limit", option + 13);
+        } else if (strncmp(option, "--heap-soft-limit=", 18) == 0) {
+            vm.softLimit = parseHeapSize("--heap-soft-limit", option + 18);
+        } else {
+            usage();
+        }
+    }
+
+    if (emit && arg == argc - 1) {
+        emitFile(argv[arg]);
+    } else if (emit) {
+        usage();
+    } else if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: fls [path]\n");
-        exit(64);
+        usage();
     }
 
     freeVM();
@@ -1,74 +1,774 @@
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
+#include "aot.h"
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/lsan_interface.h>
+#define POISON(pointer, size) ASAN_POISON_MEMORY_REGION(pointer, size)
+#define UNPOISON(pointer, size) ASAN_UNPOISON_MEMORY_REGION(pointer, size)
+// Objects in the slabs keep their arrays alive, so the leak checker has to
+// look inside the pages too.
+#define REGISTER_ROOTS(pointer, size) __lsan_register_root_region(pointer, size)
+#define UNREGISTER_ROOTS(pointer, size) \
+  __lsan_unregister_root_region(pointer, size)
+#else
+#define POISON(pointer, size) ((void)(pointer), (void)(size))
+#define UNPOISON(pointer, size) ((void)(pointer), (void)(size))
+#define REGISTER_ROOTS(pointer, size) ((void)(pointer), (void)(size))
+#define UNREGISTER_ROOTS(pointer, size) ((void)(pointer), (void)(size))
+#endif
+
+// The collector is generational. Objects start out young, in vm.nursery,
+// and the ones that survive a collection are promoted to vm.objects. Most
+// objects die young, so a minor collection runs whenever NURSERY_SIZE bytes
+// have been allocated and only traces and sweeps the nursery. Mark bits are
+// sticky: an object stays marked once promoted, so marking stops at old
+// objects, and the write barrier remembers the old objects that have had a
+// young reference stored into them for the next minor collection to trace.
+//
+// Objects never move, since natives and the compiler hold raw object
+// pointers across allocations. Promotion relinks an object from one list
+// to the other.
+//
+// A full collection marks on the main thread. Once the heap is at least
+// CONCURRENT_SWEEP_MIN, it then hands the whole heap to a background
+// sweeper thread, which frees the unmarked objects while the program runs
+// on. The main thread only waits for it when the heap reaches the
+// collection threshold again before the sweep has finished, or when the
+// next full collection starts. Until then the sweeper owns every object
+// that was allocated before the collection: the main thread only reads the
+// mark bits of the survivors, and never reaches a dead object. Smaller
+// heaps are swept in place, since they sweep quickly and malloc() is
+// cheaper while the process has a single thread.
+#define NURSERY_SIZE (256 * 1024)
+#define CONCURRENT_SWEEP_MIN (32 * 1024 * 1024)
+
+// After a full collection the next one waits until the heap has grown to
+// this multiple of what survived. A collection that finds little garbage
+// means the program's live set is growing, so the heap is given more room
+// before the next one.
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_HEAP_GROW_FACTOR_MOSTLY_LIVE 4
+#define GC_HEAP_MIN (1024 * 1024)
+
+// The sweeper thread and what the main thread has handed to it. Everything
+// here is guarded by sweepLock while a sweep is in flight.
+static pthread_t sweeper;
+static pthread_mutex_t sweepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweepCond = PTHREAD_COND_INITIALIZER;
+static bool sweeperRunning = false;
+static bool sweeperQuit = false;
+static bool sweepRequested = false;  // Set by the main thread, cleared when done.
+static Obj* sweepLists[2];           // The old objects and the nursery.
+static Obj* survivors;               // What the sweep kept, linked by next.
+static Obj* survivorsTail;
+static size_t sweptBytes;            // Freed by the sweep.
+
+// Main-thread state of the sweep in flight, if any.
+static bool sweepInFlight = false;
+static size_t sweepHeapSize;         // vm.bytesAllocated when it was handed off.
+
+static _Thread_local bool isSweeping = false;
+
+// Objects are carved out of SLAB_PAGE_SIZE pages mapped straight from the
+// system, one size class per page, with a free list per class. Blocks are SLAB_GRANULE bytes apart in size up to SLAB_MAX_SIZE;
+// anything bigger goes to malloc(). Pages are only unmapped at shutdown.
+//
+// The sweeper thread never touches the main thread's free lists. It
+// gathers the blocks it frees on lists of its own, which the main thread
+// splices onto its own when it settles the sweep.
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+#define SLAB_PAGE_SIZE (256 * 1024)
+
+typedef struct SlabBlock {
+  struct SlabBlock* next;
+} SlabBlock;
+
+typedef struct {
+  SlabBlock* free;
+  uint8_t* bump;       // Unused end of the class's newest page.
+  uint8_t* end;
+  size_t pages;
+  size_t live;         // Blocks handed out and not yet freed.
+  size_t allocations;  // Blocks ever handed out.
+} SlabClass;
+
+static SlabClass slabs[SLAB_CLASSES];
+static void** slabPages;
+static int slabPageCount;
+static int slabPageCapacity;
+
+// Blocks the sweep in flight has freed, by class. Guarded by sweepLock.
+static SlabBlock* sweptBlocks[SLAB_CLASSES];
+static SlabBlock* sweptTails[SLAB_CLASSES];
+static size_t sweptCounts[SLAB_CLASSES];
+
+static uint64_t nanoTime() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void settleSweep(bool wait);
+
+// Whether a heap of the given size breaks the hard limit. The compiler is
+// let past it: what it allocates is bounded by the source, and a heap left
+// full by an error could otherwise never run a line that frees it.
+static bool overHardLimit(size_t bytes) {
+  return vm.hardLimit != 0 && bytes > vm.hardLimit && !isCompiling();
+}
+
+// Counts a change in the size of the heap, and collects if it has grown
+// enough since the last collection. Growing past the hard limit is a
+// runtime error, unless a full collection makes room.
+static void countAllocation(size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    vm.youngBytes += newSize - oldSize;
+    if (vm.bytesAllocated > vm.peakBytes) vm.peakBytes = vm.bytesAllocated;
+#ifdef DEBUG_STRESS_GC
+    // Alternate, so that full collections and the write barriers minor ones
+    // depend on are both exercised.
+    static bool full = false;
+    full = !full;
+    if (full) {
+      collectGarbage();
+    } else {
+      collectNursery();
+    }
+#else
+    if (vm.bytesAllocated > vm.nextGC) {
+      // Until the sweep in flight is settled, the garbage it is freeing
+      // still counts, and may be all that puts the heap over.
+      if (sweepInFlight) settleSweep(true);
+      if (vm.bytesAllocated > vm.nextGC) collectGarbage();
+    } else if (vm.youngBytes > NURSERY_SIZE) {
+      collectNursery();
+    }
+#endif
+
+    if (overHardLimit(vm.bytesAllocated)) {
+      collectGarbage();
+      settleSweep(true);
+      if (vm.bytesAllocated > vm.hardLimit) {
+        // The allocation is not going to happen.
+        vm.bytesAllocated -= newSize - oldSize;
+        heapLimitError();
+      }
+    }
+  }
+}
+
+// Takes back the count of an allocation the system then refused, given the
+// peak from before it was counted, and fails the script the same way as an
+// allocation past the hard limit.
+static void allocationFailed(size_t oldSize, size_t newSize, size_t peak) {
+  size_t growth = newSize - oldSize;
+  vm.bytesAllocated -= growth;
+  if (newSize > oldSize) {
+    // A collection on the way may already have emptied the nursery count.
+    vm.youngBytes = vm.youngBytes > growth ? vm.youngBytes - growth : 0;
+  }
+  vm.peakBytes = peak;
+  heapLimitError();
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  if (isSweeping) {
+    // The sweeper only frees. Its count is settled with vm.bytesAllocated
+    // once the sweep is done.
+    sweptBytes += oldSize;
+    free(pointer);
+    return NULL;
+  }
+
+  size_t peak = vm.peakBytes;
+  countAllocation(oldSize, newSize);
   if (newSize == 0) {
     free(pointer);
     return NULL;
   }
 
+  // On failure the old block is untouched, so the caller's data survives.
   void* result = realloc(pointer, newSize);
-  if (result == NULL) exit(1);
+  if (result == NULL) allocationFailed(oldSize, newSize, peak);
   return result;
 }
 
+static int slabClass(size_t size) {
+  return (int)((size + SLAB_GRANULE - 1) / SLAB_GRANULE) - 1;
+}
+
+// Returns false, having changed nothing, if the system has no page to give.
+static bool newSlabPage(SlabClass* slab) {
+  void* page = mmap(NULL, SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (page == MAP_FAILED) return false;
+
+  if (slabPageCapacity < slabPageCount + 1) {
+    int capacity = GROW_CAPACITY(slabPageCapacity);
+    void** pages = (void**)realloc(slabPages, sizeof(void*) * capacity);
+    if (pages == NULL) {
+      munmap(page, SLAB_PAGE_SIZE);
+      return false;
+    }
+    slabPages = pages;
+    slabPageCapacity = capacity;
+  }
+  slabPages[slabPageCount++] = page;
+  POISON(page, SLAB_PAGE_SIZE);
+  REGISTER_ROOTS(page, SLAB_PAGE_SIZE);
+
+  slab->bump = (uint8_t*)page;
+  slab->end = slab->bump + SLAB_PAGE_SIZE;
+  slab->pages++;
+  return true;
+}
+
+// Returns NULL if the system is out of memory, leaving the caller to take
+// back its count of the block.
+static void* takeSlabBlock(size_t size) {
+  if (size > SLAB_MAX_SIZE) return malloc(size);
+
+  int index = slabClass(size);
+  size_t blockSize = (size_t)(index + 1) * SLAB_GRANULE;
+  SlabClass* slab = &slabs[index];
+
+  SlabBlock* block = slab->free;
+  if (block != NULL) {
+    UNPOISON(block, blockSize);
+    slab->free = block->next;
+    slab->live++;
+    slab->allocations++;
+    return block;
+  }
+
+  if (slab->bump + blockSize > slab->end && !newSlabPage(slab)) return NULL;
+  slab->live++;
+  slab->allocations++;
+  block = (SlabBlock*)slab->bump;
+  slab->bump += blockSize;
+  UNPOISON(block, blockSize);
+  return block;
+}
+
+// What a block of 'size' bytes really takes up.
+static size_t slabBlockSize(size_t size) {
+  return size > SLAB_MAX_SIZE ? size
+                              : (size_t)(slabClass(size) + 1) * SLAB_GRANULE;
+}
+
+void* slabAllocate(size_t size) {
+  size_t peak = vm.peakBytes;
+  countAllocation(0, slabBlockSize(size));
+  void* block = takeSlabBlock(size);
+  if (block == NULL) allocationFailed(0, slabBlockSize(size), peak);
+  return block;
+}
+
+void* slabAllocateNoCollect(size_t size) {
+  // Without a collection to make room, the hard limit is checked as is.
+  // This must not be a way around it.
+  if (overHardLimit(vm.bytesAllocated + slabBlockSize(size))) {
+    heapLimitError();
+  }
+  size_t peak = vm.peakBytes;
+  vm.bytesAllocated += slabBlockSize(size);
+  vm.youngBytes += slabBlockSize(size);
+  if (vm.bytesAllocated > vm.peakBytes) vm.peakBytes = vm.bytesAllocated;
+  void* block = takeSlabBlock(size);
+  if (block == NULL) allocationFailed(0, slabBlockSize(size), peak);
+  return block;
+}
+
+void slabFree(void* pointer, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    if (isSweeping) {
+      sweptBytes += size;
+    } else {
+      vm.bytesAllocated -= size;
+    }
+    free(pointer);
+    return;
+  }
+
+  int index = slabClass(size);
+  size_t blockSize = (size_t)(index + 1) * SLAB_GRANULE;
+  SlabBlock* block = (SlabBlock*)pointer;
+  if (isSweeping) {
+    sweptBytes += blockSize;
+    if (sweptBlocks[index] == NULL) sweptTails[index] = block;
+    block->next = sweptBlocks[index];
+    sweptBlocks[index] = block;
+    sweptCounts[index]++;
+  } else {
+    vm.bytesAllocated -= blockSize;
+    block->next = slabs[index].free;
+    slabs[index].free = block;
+    slabs[index].live--;
+  }
+  POISON(block, blockSize);
+}
+
 static void freeObject(Obj* object) {
   switch (object->type) {
     case OBJ_MODULE: {
       ObjModule* module = (ObjModule*)object;
       freeTable(&module->variables);
-      FREE(ObjModule, object);
+      FREE_SLAB(ObjModule, object, 1);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       FREE_ARRAY(ObjUpvalue*, closure->upvalues,
                  closure->upvalueCount);
-      FREE(ObjClosure, object);
+      FREE_SLAB(ObjClosure, object, 1);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       freeChunk(&function->chunk);
-      FREE(ObjFunction, object);
+#ifdef FLS_JIT
+      freeJitCode(function);
+#endif
+      FREE_SLAB(ObjFunction, object, 1);
       break;
     }
     case OBJ_LIST: {
       ObjList* list = (ObjList*)object;
-      freeValueArray(list->items);
-      FREE(ValueArray, list->items);
-      FREE(ObjList, object);
+      if (LIST_STORAGE(list) != list->inlineItems) {
+        FREE_ARRAY(Value, LIST_STORAGE(list),
+                   list->head + list->items.capacity);
+      }
+      FREE_SLAB(ObjList, object, 1);
       break;
     }
     case OBJ_MAP: {
       ObjMap* map = (ObjMap*)object;
       freeTable(&map->table);
-      FREE(ObjMap, object);
+      FREE_SLAB(ObjMap, object, 1);
       break;
     }
     case OBJ_NATIVE:
-      FREE(ObjNative, object);
+      FREE_SLAB(ObjNative, object, 1);
+      break;
+    case OBJ_ROPE:
+      FREE_SLAB(ObjRope, object, 1);
       break;
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      slabFree(object, STRING_SIZE(string->length));
       break;
     }
     case OBJ_UPVALUE:
-      FREE(ObjUpvalue, object);
+      FREE_SLAB(ObjUpvalue, object, 1);
       break;
   }
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
+void markObject(Obj* object) {
+  if (object == NULL || object->isMarked) return;
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+  object->isMarked = true;
+
+  // The gray stack and the remembered set are grown with the system
+  // allocator so that collecting never recurses into the collector.
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    vm.grayStack = (Obj**)realloc(vm.grayStack,
+                                  sizeof(Obj*) * vm.grayCapacity);
+    if (vm.grayStack == NULL) exit(1);
+  }
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+void rememberObject(Obj* object) {
+  if (object->isRemembered) return;
+  object->isRemembered = true;
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = (Obj**)realloc(vm.remembered,
+                                   sizeof(Obj*) * vm.rememberedCapacity);
+    if (vm.remembered == NULL) exit(1);
+  }
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+void markValue(Value value) {
+  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(array->values[i]);
+  }
+}
+
+static void blackenObject(Obj* object) {
+  switch (object->type) {
+    case OBJ_MODULE: {
+      ObjModule* module = (ObjModule*)object;
+      markObject((Obj*)module->name);
+      markTable(&module->variables);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      markObject((Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        markObject((Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      markObject((Obj*)function->name);
+      markObject((Obj*)function->module);
+      markArray(&function->chunk.constants);
+      break;
+    }
+    case OBJ_LIST:
+      markArray(&((ObjList*)object)->items);
+      break;
+    case OBJ_MAP:
+      markTable(&((ObjMap*)object)->table);
+      break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
+      break;
+    }
+    case OBJ_UPVALUE:
+      markValue(((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+static void markRoots() {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    markValue(*slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    markObject((Obj*)vm.frames[i].function);
+  }
+  markTable(&vm.globals);
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
+  markTable(&vm.modules);
+  markCompilerRoots();
+  markAotRoots();
+}
+
+static void traceReferences() {
+  while (vm.grayCount > 0) {
+    Obj* object = vm.grayStack[--vm.grayCount];
+    blackenObject(object);
+  }
+}
+
+// Frees the unmarked young objects and promotes the rest, which stay
+// marked from now on.
+static void sweepNursery() {
+  Obj* object = vm.nursery;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->isMarked) {
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      // The string table only interns strings; it does not keep them alive.
+      if (object->type == OBJ_STRING && isInterned((ObjString*)object)) {
+        tableDeleteNoShrink(&vm.strings, (ObjString*)object);
+      }
+      freeObject(object);
+    }
+    object = next;
+  }
+  vm.nursery = NULL;
+  vm.youngBytes = 0;
+}
+
+// Runs on the sweeper thread.
+static void sweepList(Obj* object) {
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->isMarked) {
+      object->next = NULL;
+      if (survivorsTail == NULL) {
+        survivors = object;
+      } else {
+        survivorsTail->next = object;
+      }
+      survivorsTail = object;
+    } else {
+      freeObject(object);
+    }
+    object = next;
+  }
+}
+
+static void sweepHandedOff() {
+  isSweeping = true;
+  survivors = NULL;
+  survivorsTail = NULL;
+  sweptBytes = 0;
+  sweepList(sweepLists[0]);
+  sweepList(sweepLists[1]);
+  isSweeping = false;
+}
+
+static void* runSweeper(void* unused) {
+  (void)unused;
+  pthread_mutex_lock(&sweepLock);
+  for (;;) {
+    while (!sweepRequested && !sweeperQuit) {
+      pthread_cond_wait(&sweepCond, &sweepLock);
+    }
+    if (!sweepRequested) break;
+    pthread_mutex_unlock(&sweepLock);
+
+    sweepHandedOff();
+
+    pthread_mutex_lock(&sweepLock);
+    sweepRequested = false;
+    pthread_cond_broadcast(&sweepCond);
+  }
+  pthread_mutex_unlock(&sweepLock);
+  return NULL;
+}
+
+// Hands the old objects and the nursery to the sweeper, leaving both lists
+// empty for the program to carry on with, or sweeps them right away.
+static void startSweep(bool inBackground) {
+  sweepLists[0] = vm.objects;
+  sweepLists[1] = vm.nursery;
+  vm.objects = NULL;
+  vm.nursery = NULL;
+  vm.youngBytes = 0;
+  sweepHeapSize = vm.bytesAllocated;
+  sweepInFlight = true;
+
+  if (!inBackground) {
+    sweepHandedOff();
+    settleSweep(true);
+    return;
+  }
+
+  // Until the sweep settles, the heap may double before the program waits
+  // for it.
+  vm.nextGC = sweepHeapSize * GC_HEAP_GROW_FACTOR;
+  if (vm.softLimit != 0 && vm.nextGC > vm.softLimit) vm.nextGC = vm.softLimit;
+
+  if (!sweeperRunning) {
+    sweeperQuit = false;
+    if (pthread_create(&sweeper, NULL, runSweeper, NULL) != 0) exit(1);
+    sweeperRunning = true;
+  }
+  pthread_mutex_lock(&sweepLock);
+  sweepRequested = true;
+  pthread_cond_signal(&sweepCond);
+  pthread_mutex_unlock(&sweepLock);
+}
+
+// Takes back the survivors of the sweep in flight and accounts for what it
+// freed. Unless 'wait' is set, does nothing if the sweep is still running.
+static void settleSweep(bool wait) {
+  if (!sweepInFlight) return;
+
+  pthread_mutex_lock(&sweepLock);
+  if (sweepRequested) {
+    if (!wait) {
+      pthread_mutex_unlock(&sweepLock);
+      return;
+    }
+    uint64_t start = nanoTime();
+    while (sweepRequested) pthread_cond_wait(&sweepCond, &sweepLock);
+    vm.gcStats.sweepWaitTime += nanoTime() - start;
+  }
+
+  if (survivors != NULL) {
+    survivorsTail->next = vm.objects;
+    vm.objects = survivors;
+  }
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    if (sweptBlocks[i] == NULL) continue;
+    UNPOISON(sweptTails[i], sizeof(SlabBlock));
+    sweptTails[i]->next = slabs[i].free;
+    POISON(sweptTails[i], sizeof(SlabBlock));
+    slabs[i].free = sweptBlocks[i];
+    slabs[i].live -= sweptCounts[i];
+    sweptBlocks[i] = NULL;
+    sweptCounts[i] = 0;
+  }
+  size_t freed = sweptBytes;
+  pthread_mutex_unlock(&sweepLock);
+  sweepInFlight = false;
+
+  vm.bytesAllocated -= freed;
+  vm.gcStats.bytesFreed += freed;
+
+  size_t live = sweepHeapSize - freed;
+  int factor = live > sweepHeapSize / 2 ? GC_HEAP_GROW_FACTOR_MOSTLY_LIVE
+                                        : GC_HEAP_GROW_FACTOR;
+  vm.nextGC = live * factor;
+  if (vm.nextGC < GC_HEAP_MIN) vm.nextGC = GC_HEAP_MIN;
+  if (vm.softLimit != 0 && vm.nextGC > vm.softLimit) {
+    // Collect at the soft limit, unless so much survives that collecting
+    // there would leave little room before the next one.
+    size_t headroom = live + live / 4;
+    vm.nextGC = vm.softLimit > headroom ? vm.softLimit : headroom;
+  }
+
+#ifdef DEBUG_LOG_GC
+  printf("-- sweep end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         freed, sweepHeapSize, live, vm.nextGC);
+#endif
+}
+
+static void recordPause(uint64_t start, uint64_t* total, uint64_t* max) {
+  uint64_t pause = nanoTime() - start;
+  *total += pause;
+  if (pause > *max) *max = pause;
+}
+
+void collectNursery() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+#endif
+  uint64_t start = nanoTime();
+  settleSweep(false);
+  size_t before = vm.bytesAllocated;
+
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    blackenObject(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+  traceReferences();
+  sweepNursery();
+
+  vm.gcStats.bytesFreed += before - vm.bytesAllocated;
+  vm.gcStats.minorCollections++;
+  recordPause(start, &vm.gcStats.minorPauseTime, &vm.gcStats.maxMinorPause);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+  uint64_t start = nanoTime();
+  settleSweep(true);
+
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    object->isMarked = false;
+    object->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+
+  markRoots();
+  traceReferences();
+  // The string table belongs to the main thread, so dead strings leave it
+  // here rather than on the sweeper.
+  tableRemoveWhite(&vm.strings);
+#ifdef DEBUG_STRESS_GC
+  bool inBackground = true;  // Exercise the sweeper on every heap.
+#else
+  bool inBackground = vm.bytesAllocated >= CONCURRENT_SWEEP_MIN;
+#endif
+  startSweep(inBackground);
+
+  vm.gcStats.fullCollections++;
+  recordPause(start, &vm.gcStats.fullPauseTime, &vm.gcStats.maxFullPause);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+#endif
+}
+
+static void freeList(Obj* object) {
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
 }
+
+void freeObjects() {
+  settleSweep(true);
+#ifdef DEBUG_LOG_GC
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    if (slabs[i].pages == 0) continue;
+    printf("   slab %3d: %zu pages, %zu allocations, %zu live\n",
+           (i + 1) * SLAB_GRANULE, slabs[i].pages, slabs[i].allocations,
+           slabs[i].live);
+  }
+#endif
+
+  if (sweeperRunning) {
+    pthread_mutex_lock(&sweepLock);
+    sweeperQuit = true;
+    pthread_cond_signal(&sweepCond);
+    pthread_mutex_unlock(&sweepLock);
+    pthread_join(sweeper, NULL);
+    sweeperRunning = false;
+  }
+
+  freeList(vm.objects);
+  freeList(vm.nursery);
+  vm.objects = NULL;
+  vm.nursery = NULL;
+
+  free(vm.grayStack);
+  vm.grayStack = NULL;
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  free(vm.remembered);
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+
+  for (int i = 0; i < slabPageCount; i++) {
+    UNPOISON(slabPages[i], SLAB_PAGE_SIZE);
+    UNREGISTER_ROOTS(slabPages[i], SLAB_PAGE_SIZE);
+    munmap(slabPages[i], SLAB_PAGE_SIZE);
+  }
+  free(slabPages);
+  slabPages = NULL;
+  slabPageCount = 0;
+  slabPageCapacity = 0;
+  memset(slabs, 0, sizeof(slabs));
+}
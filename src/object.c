@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -11,11 +12,18 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+// Links a newly allocated object into the nursery.
+static void initObject(Obj* object, ObjType type) {
   object->type = type;
-  object->next = vm.objects;
-  vm.objects = object;
+  object->isMarked = false;
+  object->isRemembered = false;
+  object->next = vm.nursery;
+  vm.nursery = object;
+}
+
+static Obj* allocateObject(size_t size, ObjType type) {
+  Obj* object = (Obj*)slabAllocate(size);
+  initObject(object, type);
   return object;
 }
 
@@ -36,18 +44,119 @@ ObjFunction* newFunction() {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->registerCount = 0;
+  function->hotness = 0;
+  function->jit = NULL;
+  function->aot = NULL;
   function->name = NULL;
+  function->module = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
 ObjList* newList() {
   ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
-  list->items = ALLOCATE(ValueArray, 1);
-  initValueArray(list->items);
+  list->items.count = 0;
+  list->items.capacity = LIST_INLINE_CAPACITY;
+  list->items.values = list->inlineItems;
+  list->head = 0;
   return list;
 }
 
+// Moves a list's items into a new allocation of 'capacity' values, with
+// 'head' free slots in front of them.
+static void resizeList(ObjList* list, int capacity, int head) {
+  ValueArray* items = &list->items;
+  Value* values = ALLOCATE(Value, capacity);
+  memcpy(values + head, items->values, sizeof(Value) * items->count);
+  if (LIST_STORAGE(list) != list->inlineItems) {
+    FREE_ARRAY(Value, LIST_STORAGE(list), list->head + items->capacity);
+  }
+  list->head = head;
+  items->values = values + head;
+  items->capacity = capacity - head;
+}
+
+void listAppend(ObjList* list, Value value) {
+  ValueArray* items = &list->items;
+  if (items->capacity < items->count + 1) {
+    int oldCapacity = list->head + items->capacity;
+    if (list->head >= items->count) {
+      // Shifts have freed at least half the storage. Sliding the items back
+      // costs no more than those shifts did, so a queue stays amortized O(1)
+      // without growing.
+      memmove(LIST_STORAGE(list), items->values,
+              sizeof(Value) * items->count);
+      items->values = LIST_STORAGE(list);
+      items->capacity = oldCapacity;
+      list->head = 0;
+    } else if (list->head > 0 || items->values == list->inlineItems) {
+      resizeList(list, GROW_CAPACITY(oldCapacity), 0);
+    } else {
+      int capacity = GROW_CAPACITY(oldCapacity);
+      items->values = GROW_ARRAY(Value, items->values, oldCapacity, capacity);
+      items->capacity = capacity;
+    }
+  }
+
+  items->values[items->count++] = value;
+}
+
+void listPrepend(ObjList* list, Value value) {
+  ValueArray* items = &list->items;
+  if (list->head == 0) {
+    // Open room in front in proportion to the list, reusing the free slots at
+    // the back when at least half the storage is free, so that a run of
+    // unshifts is amortized O(1) like a run of appends.
+    int oldCapacity = items->capacity;
+    if (oldCapacity - items->count >= items->count) {
+      int head = (oldCapacity - items->count + 1) / 2;
+      memmove(items->values + head, items->values,
+              sizeof(Value) * items->count);
+      list->head = head;
+      items->values += head;
+      items->capacity -= head;
+    } else {
+      int capacity = GROW_CAPACITY(oldCapacity);
+      resizeList(list, capacity, (capacity - items->count) / 2);
+    }
+  }
+
+  list->head--;
+  items->values--;
+  items->capacity++;
+  items->count++;
+  items->values[0] = value;
+}
+
+Value listShift(ObjList* list) {
+  ValueArray* items = &list->items;
+  Value value = items->values[0];
+  items->count--;
+  if (items->count == 0) {
+    // An empty list can hand its front slots back without moving anything.
+    items->values = LIST_STORAGE(list);
+    items->capacity += list->head;
+    list->head = 0;
+  } else {
+    items->values++;
+    items->capacity--;
+    list->head++;
+  }
+  return value;
+}
+
+void listClear(ObjList* list) {
+  if (LIST_STORAGE(list) != list->inlineItems) {
+    FREE_ARRAY(Value, LIST_STORAGE(list),
+               list->head + list->items.capacity);
+  }
+  list->items.count = 0;
+  list->items.capacity = LIST_INLINE_CAPACITY;
+  list->items.values = list->inlineItems;
+  list->head = 0;
+}
+
 ObjMap* newMap() {
     ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
     initTable(&map->table);
@@ -67,16 +176,20 @@ ObjNative* newNative(NativeFn function) {
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
+// Links a filled-in string into the nursery, and interns it if it is short
+// enough.
+static ObjString* internString(ObjString* string, uint32_t hash) {
+  initObject((Obj*)string, OBJ_STRING);
   string->hash = hash;
+  if (!isInterned(string)) return string;
+
+  push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
+  pop();
   return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
+uint32_t hashString(const char* key, int length) {
   uint32_t hash = 2166136261u;
   for (int i = 0; i < length; i++) {
     hash ^= (uint8_t)key[i];
@@ -85,25 +198,125 @@ static uint32_t hashString(const char* key, int length) {
   return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString* reserveString(int length) {
+  // Not linked in until takeString(), so a string that turns out to be
+  // interned already can go straight back to the slab.
+  ObjString* string = (ObjString*)slabAllocate(STRING_SIZE(length));
+  string->length = length;
+  string->chars[length] = '\0';
+  return string;
+}
+
+ObjString* takeString(ObjString* string) {
+  int length = string->length;
+  if (!isInterned(string)) return internString(string, 0);
+
+  uint32_t hash = hashString(string->chars, length);
+  ObjString* interned = tableFindString(&vm.strings, string->chars, length,
+                                        hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+    discardString(string);
     return interned;
   }
-  return allocateString(chars, length, hash);
+  return internString(string, hash);
+}
+
+void discardString(ObjString* string) {
+  // The string never reached the nursery, so it should not bring the next
+  // minor collection any closer either.
+  size_t size = STRING_SIZE(string->length);
+  slabFree(string, size);
+  vm.youngBytes = vm.youngBytes > size ? vm.youngBytes - size : 0;
 }
 
 ObjString* copyString(const char* chars, int length) {
+  if (length > STRING_INTERN_MAX) {
+    ObjString* string = reserveString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, 0);
+  }
+
   uint32_t hash = hashString(chars, length);
   ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString* string = reserveString(length);
+  memcpy(string->chars, chars, length);
+  return internString(string, hash);
+}
+
+Obj* concatenateStrings(Obj* a, Obj* b) {
+  int length = stringLength(a) + stringLength(b);
+  if (length > STRING_INTERN_MAX) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return (Obj*)rope;
+  }
+
+  // Ropes are all longer than this, so both sides are flat.
+  ObjString* left = (ObjString*)a;
+  ObjString* right = (ObjString*)b;
+  ObjString* result = reserveString(length);
+  memcpy(result->chars, left->chars, left->length);
+  memcpy(result->chars + left->length, right->chars, right->length);
+  return (Obj*)takeString(result);
+}
+
+ObjString* flattenRope(ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  size_t peak = vm.peakBytes;
+  ObjString* string =
+      (ObjString*)slabAllocateNoCollect(STRING_SIZE(rope->length));
+  string->length = rope->length;
+  string->chars[rope->length] = '\0';
+
+  // Fill in from the end. Strings built by appending are left-deep, so
+  // taking right children first keeps the stack of pending left children
+  // short. It is grown with the system allocator, like the gray stack.
+  Obj** pending = NULL;
+  int pendingCount = 0;
+  int pendingCapacity = 0;
+  char* end = string->chars + rope->length;
+  Obj* node = (Obj*)rope;
+  for (;;) {
+    if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat == NULL) {
+      ObjRope* inner = (ObjRope*)node;
+      if (pendingCapacity < pendingCount + 1) {
+        pendingCapacity = GROW_CAPACITY(pendingCapacity);
+        Obj** grown = (Obj**)realloc(pending, sizeof(Obj*) * pendingCapacity);
+        if (grown == NULL) {
+          // The string was never handed out, so it goes back uncounted.
+          free(pending);
+          slabFree(string, STRING_SIZE(rope->length));
+          vm.peakBytes = peak;
+          heapLimitError();
+        }
+        pending = grown;
+      }
+      pending[pendingCount++] = inner->left;
+      node = inner->right;
+      continue;
+    }
+
+    ObjString* leaf = node->type == OBJ_STRING ? (ObjString*)node
+                                               : ((ObjRope*)node)->flat;
+    end -= leaf->length;
+    memcpy(end, leaf->chars, leaf->length);
+    if (pendingCount == 0) break;
+    node = pending[--pendingCount];
+  }
+  free(pending);
+
+  internString(string, 0);
+  rope->flat = string;
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier((Obj*)rope, OBJ_VAL(string));
+  return string;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -146,6 +359,7 @@ void printObject(Value value) {
       printf("<native fn>");
       break;
     case OBJ_STRING:
+    case OBJ_ROPE:
       printf("%s", AS_CSTRING(value));
       break;
     case OBJ_UPVALUE:
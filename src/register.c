@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+
+// The register backend translates the stack bytecode the compiler produced
+// for a function rather than parsing the source a second time. The stack
+// depth before every stack instruction is known statically, so the value at
+// depth d lives in register d: locals already sit in their slots and
+// temporaries become the registers just above them.
+//
+// Values are pushed lazily. A constant or a local read is recorded as a
+// pending operand and only copied into its register when something needs it
+// there, so `i = i + 1` becomes a single ROP_ADDK that writes straight into
+// the local instead of four stack instructions.
+
+typedef enum {
+    OPERAND_REGISTER,  // The value is already in its own register.
+    OPERAND_LOCAL,     // The value is whatever local 'index' currently holds.
+    OPERAND_CONSTANT,  // The value is constant 'index'.
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    uint8_t index;
+} Operand;
+
+// A jump operand to fill in once every instruction's new offset is known.
+typedef struct {
+    int operand;  // Offset of the operand in the register code.
+    int target;   // Offset of the jump target in the stack code.
+    int from;     // Register code offset the jump is relative to.
+    int sign;     // -1 for ROP_LOOP.
+} RegisterJump;
+
+typedef struct {
+    Chunk* source;
+    Chunk code;
+    int line;
+
+    Operand stack[UINT8_COUNT];
+    int depth;
+    int registerCount;
+
+    // Offset of the destination operand of the last instruction emitted, if
+    // that instruction may be retargeted to write a local directly; else -1.
+    int lastDestination;
+
+    int* targetDepths;  // Stack depth at each jump target, -1 elsewhere.
+    int* newOffsets;    // Stack code offset -> register code offset.
+    RegisterJump* jumps;
+    int jumpCount;
+    bool tooManyRegisters;
+} RegisterCompiler;
+
+// The translation in progress, with a NULL source when there is none. It
+// lives here rather than on the stack so that abandonRegisterCompilation()
+// can free its buffers if running out of memory unwinds out of it.
+static RegisterCompiler translation;
+
+static void emitByte(RegisterCompiler* rc, uint8_t byte) {
+    writeChunk(&rc->code, byte, rc->line);
+}
+
+// Emits an instruction whose first operand is the register it writes.
+// 'retargetable' marks instructions that may later be rewritten to write a
+// local instead (see setLocal()).
+static void emitWrite(RegisterCompiler* rc, uint8_t instruction, int dest,
+                      bool retargetable) {
+    emitByte(rc, instruction);
+    rc->lastDestination = retargetable ? rc->code.count : -1;
+    emitByte(rc, (uint8_t)dest);
+}
+
+static void emitOperand(RegisterCompiler* rc, uint8_t instruction) {
+    emitByte(rc, instruction);
+    rc->lastDestination = -1;
+}
+
+// Emits a two-byte jump operand to be relocated to 'target' later.
+static void emitJumpOperand(RegisterCompiler* rc, int target, int sign) {
+    RegisterJump* jump = &rc->jumps[rc->jumpCount++];
+    jump->operand = rc->code.count;
+    jump->target = target;
+    jump->sign = sign;
+    emitByte(rc, 0xff);
+    emitByte(rc, 0xff);
+    jump->from = rc->code.count;
+}
+
+static void pushOperand(RegisterCompiler* rc, OperandKind kind, int index) {
+    if (rc->depth == UINT8_COUNT) {
+        rc->tooManyRegisters = true;
+        return;
+    }
+    rc->stack[rc->depth].kind = kind;
+    rc->stack[rc->depth].index = (uint8_t)index;
+    rc->depth++;
+    if (rc->depth > rc->registerCount) rc->registerCount = rc->depth;
+}
+
+// Copies a pending operand into its own register.
+static void materialize(RegisterCompiler* rc, int reg) {
+    Operand* operand = &rc->stack[reg];
+    switch (operand->kind) {
+        case OPERAND_CONSTANT:
+            emitWrite(rc, ROP_LOADK, reg, true);
+            emitByte(rc, operand->index);
+            break;
+        case OPERAND_LOCAL:
+            if (operand->index != reg) {
+                emitWrite(rc, ROP_MOVE, reg, true);
+                emitByte(rc, operand->index);
+            }
+            break;
+        case OPERAND_REGISTER:
+            return;
+    }
+    operand->kind = OPERAND_REGISTER;
+}
+
+// Materializes registers [from, to). Control flow can only merge where every
+// live value is in its own register.
+static void materializeRange(RegisterCompiler* rc, int from, int to) {
+    for (int reg = from; reg < to; reg++) {
+        materialize(rc, reg);
+    }
+}
+
+// Returns a register holding the value at 'reg', copying a pending constant
+// into place if needed.
+static uint8_t readRegister(RegisterCompiler* rc, int reg) {
+    Operand* operand = &rc->stack[reg];
+    if (operand->kind == OPERAND_LOCAL) return operand->index;
+    materialize(rc, reg);
+    return (uint8_t)reg;
+}
+
+// Emits a binary operation on the top two values. The right operand is
+// encoded as a constant when the instruction has a K form.
+static void binaryOp(RegisterCompiler* rc, uint8_t instruction,
+                     uint8_t constantInstruction) {
+    int left = rc->depth - 2;
+    Operand right = rc->stack[rc->depth - 1];
+
+    uint8_t b = readRegister(rc, left);
+    if (right.kind == OPERAND_CONSTANT) {
+        emitWrite(rc, constantInstruction, left, true);
+        emitByte(rc, b);
+        emitByte(rc, right.index);
+    } else {
+        uint8_t c = readRegister(rc, rc->depth - 1);
+        emitWrite(rc, instruction, left, true);
+        emitByte(rc, b);
+        emitByte(rc, c);
+    }
+
+    rc->depth--;
+    rc->stack[left].kind = OPERAND_REGISTER;
+}
+
+// Stores the top value into a local, leaving it on the stack.
+static void setLocal(RegisterCompiler* rc, uint8_t local) {
+    int top = rc->depth - 1;
+    Operand value = rc->stack[top];
+    if (value.kind == OPERAND_LOCAL && value.index == local) return;
+
+    // Pending reads of the local must see its old value.
+    int emitted = rc->code.count;
+    for (int reg = 0; reg < top; reg++) {
+        if (rc->stack[reg].kind == OPERAND_LOCAL &&
+            rc->stack[reg].index == local) {
+            materialize(rc, reg);
+        }
+    }
+
+    if (value.kind == OPERAND_REGISTER && rc->code.count == emitted &&
+        rc->lastDestination != -1 &&
+        rc->code.code[rc->lastDestination] == top) {
+        // The value was just computed into a temporary: compute it straight
+        // into the local instead.
+        rc->code.code[rc->lastDestination] = local;
+    } else if (value.kind == OPERAND_CONSTANT) {
+        emitWrite(rc, ROP_LOADK, local, false);
+        emitByte(rc, value.index);
+    } else {
+        emitWrite(rc, ROP_MOVE, local, false);
+        emitByte(rc, value.kind == OPERAND_LOCAL ? value.index : (uint8_t)top);
+    }
+    rc->lastDestination = -1;
+
+    if (local < top) rc->stack[local].kind = OPERAND_REGISTER;
+    rc->stack[top].kind = OPERAND_LOCAL;
+    rc->stack[top].index = local;
+}
+
+// Returns true if the condition tested by the OP_JUMP_IF_FALSE at 'offset'
+// is popped on both paths, so it never needs to be stored anywhere.
+static bool conditionIsDiscarded(RegisterCompiler* rc, int offset) {
+    Chunk* source = rc->source;
+    int next = offset + 3;
+    return next < source->count && source->code[next] == OP_POP &&
+           rc->targetDepths[next] == -1 &&
+           source->code[jumpTarget(source, offset)] == OP_POP;
+}
+
+static bool isUnconditional(uint8_t instruction) {
+    return instruction == OP_JUMP || instruction == OP_LOOP ||
+           instruction == OP_RETURN;
+}
+
+// Records the stack depth at every jump target. Code that follows an
+// unconditional jump starts at the depth of whatever jumps to it.
+static void findTargetDepths(RegisterCompiler* rc, int arity) {
+    Chunk* source = rc->source;
+    for (int offset = 0; offset <= source->count; offset++) {
+        rc->targetDepths[offset] = -1;
+    }
+
+    int depth = arity + 1;
+    bool reachable = true;
+    for (int offset = 0; offset < source->count;
+         offset += 1 + operandBytes(source->code[offset])) {
+        if (!reachable && rc->targetDepths[offset] != -1) {
+            depth = rc->targetDepths[offset];
+        }
+
+        uint8_t instruction = source->code[offset];
+        if (isJump(instruction)) {
+            rc->targetDepths[jumpTarget(source, offset)] = depth;
+        }
+        depth += stackEffect(source, offset);
+        reachable = !isUnconditional(instruction);
+    }
+}
+
+// Translates the stack instruction at 'offset'. Returns the offset of the
+// next stack instruction to translate, or -1 if the instruction has no
+// register form.
+static int translate(RegisterCompiler* rc, int offset) {
+    Chunk* source = rc->source;
+    uint8_t instruction = source->code[offset];
+    uint8_t* operands = &source->code[offset + 1];
+    int next = offset + 1 + operandBytes(instruction);
+    int top = rc->depth - 1;
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            pushOperand(rc, OPERAND_CONSTANT, operands[0]);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE: {
+            static const uint8_t loads[] = {
+                [OP_NIL] = ROP_LOADNIL,
+                [OP_TRUE] = ROP_LOADTRUE,
+                [OP_FALSE] = ROP_LOADFALSE,
+            };
+            emitWrite(rc, loads[instruction], rc->depth, true);
+            pushOperand(rc, OPERAND_REGISTER, 0);
+            break;
+        }
+        case OP_POP:
+            rc->depth--;
+            break;
+        case OP_GET_LOCAL:
+            materialize(rc, operands[0]);
+            pushOperand(rc, OPERAND_LOCAL, operands[0]);
+            break;
+        case OP_SET_LOCAL:
+            setLocal(rc, operands[0]);
+            break;
+        case OP_GET_GLOBAL_SLOT:
+            emitWrite(rc, ROP_GET_GLOBAL, rc->depth, true);
+            emitByte(rc, operands[0]);
+            emitByte(rc, operands[1]);
+            pushOperand(rc, OPERAND_REGISTER, 0);
+            break;
+        case OP_SET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT: {
+            uint8_t value = readRegister(rc, top);
+            emitOperand(rc, instruction == OP_SET_GLOBAL_SLOT
+                                ? ROP_SET_GLOBAL : ROP_DEFINE_GLOBAL);
+            emitByte(rc, operands[0]);
+            emitByte(rc, operands[1]);
+            emitByte(rc, value);
+            if (instruction == OP_DEFINE_GLOBAL_SLOT) rc->depth--;
+            break;
+        }
+        case OP_LESS:
+            // Fuse `a < b` with the branch of an if, while or for when the
+            // condition is discarded on both paths.
+            if (source->code[next] == OP_JUMP_IF_FALSE &&
+                rc->targetDepths[next] == -1 && conditionIsDiscarded(rc, next)) {
+                int left = rc->depth - 2;
+                Operand right = rc->stack[rc->depth - 1];
+                uint8_t b = readRegister(rc, left);
+                uint8_t c = right.kind == OPERAND_CONSTANT
+                    ? right.index : readRegister(rc, rc->depth - 1);
+                materializeRange(rc, 0, left);
+
+                emitOperand(rc, right.kind == OPERAND_CONSTANT
+                                    ? ROP_JUMP_IF_NOT_LESSK
+                                    : ROP_JUMP_IF_NOT_LESS);
+                emitByte(rc, b);
+                emitByte(rc, c);
+                emitJumpOperand(rc, jumpTarget(source, next), 1);
+
+                // Skip the jump and the POP that follows it.
+                rc->depth -= 2;
+                int pop = next + 3;
+                rc->newOffsets[next] = rc->newOffsets[pop] = rc->code.count;
+                return pop + 1;
+            }
+            binaryOp(rc, ROP_LESS, ROP_LESSK);
+            break;
+        case OP_EQUAL:    binaryOp(rc, ROP_EQUAL, ROP_EQUALK); break;
+        case OP_GREATER:  binaryOp(rc, ROP_GREATER, ROP_GREATERK); break;
+        case OP_ADD:      binaryOp(rc, ROP_ADD, ROP_ADDK); break;
+        case OP_SUBTRACT: binaryOp(rc, ROP_SUBTRACT, ROP_SUBTRACTK); break;
+        case OP_MULTIPLY: binaryOp(rc, ROP_MULTIPLY, ROP_MULTIPLYK); break;
+        case OP_DIVIDE:   binaryOp(rc, ROP_DIVIDE, ROP_DIVIDEK); break;
+        case OP_MODULO:   binaryOp(rc, ROP_MODULO, ROP_MODULOK); break;
+        case OP_NOT:
+        case OP_NEGATE: {
+            uint8_t b = readRegister(rc, top);
+            emitWrite(rc, instruction == OP_NOT ? ROP_NOT : ROP_NEGATE, top, true);
+            emitByte(rc, b);
+            rc->stack[top].kind = OPERAND_REGISTER;
+            break;
+        }
+        case OP_JUMP:
+            materializeRange(rc, 0, rc->depth);
+            emitOperand(rc, ROP_JUMP);
+            emitJumpOperand(rc, jumpTarget(source, offset), 1);
+            break;
+        case OP_JUMP_IF_FALSE: {
+            uint8_t condition;
+            if (conditionIsDiscarded(rc, offset)) {
+                // Both paths pop the condition, so it can stay wherever it is.
+                condition = readRegister(rc, top);
+                materializeRange(rc, 0, top);
+            } else {
+                // `and` and `or` leave the condition as their result.
+                materializeRange(rc, 0, rc->depth);
+                condition = (uint8_t)top;
+            }
+            emitOperand(rc, ROP_JUMP_IF_FALSE);
+            emitByte(rc, condition);
+            emitJumpOperand(rc, jumpTarget(source, offset), 1);
+            break;
+        }
+        case OP_LOOP:
+            materializeRange(rc, 0, rc->depth);
+            emitOperand(rc, ROP_LOOP);
+            emitJumpOperand(rc, jumpTarget(source, offset), -1);
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            int argCount = operands[0];
+            int callee = rc->depth - argCount - 1;
+            materializeRange(rc, callee, rc->depth);
+            emitOperand(rc, instruction == OP_CALL ? ROP_CALL : ROP_TAIL_CALL);
+            emitByte(rc, (uint8_t)callee);
+            emitByte(rc, (uint8_t)argCount);
+            rc->depth = callee + 1;
+            break;
+        }
+        case OP_RETURN: {
+            uint8_t value = readRegister(rc, top);
+            emitOperand(rc, ROP_RETURN);
+            emitByte(rc, value);
+            rc->depth--;
+            break;
+        }
+        case OP_NEW_LIST:
+            emitWrite(rc, ROP_NEW_LIST, rc->depth, false);
+            pushOperand(rc, OPERAND_REGISTER, 0);
+            break;
+        case OP_LIST_APPEND: {
+            uint8_t item = readRegister(rc, top);
+            emitOperand(rc, ROP_LIST_APPEND);
+            emitByte(rc, (uint8_t)(top - 1));
+            emitByte(rc, item);
+            rc->depth--;
+            break;
+        }
+        case OP_GET_SUBSCRIPT: {
+            uint8_t list = readRegister(rc, top - 1);
+            uint8_t index = readRegister(rc, top);
+            emitWrite(rc, ROP_GET_SUBSCRIPT, top - 1, true);
+            emitByte(rc, list);
+            emitByte(rc, index);
+            rc->depth--;
+            rc->stack[top - 1].kind = OPERAND_REGISTER;
+            break;
+        }
+        case OP_SET_SUBSCRIPT: {
+            uint8_t list = readRegister(rc, top - 2);
+            uint8_t index = readRegister(rc, top - 1);
+            uint8_t value = readRegister(rc, top);
+            emitWrite(rc, ROP_SET_SUBSCRIPT, top - 2, false);
+            emitByte(rc, list);
+            emitByte(rc, index);
+            emitByte(rc, value);
+            rc->depth -= 2;
+            rc->stack[top - 2].kind = OPERAND_REGISTER;
+            break;
+        }
+        case OP_IMPORT:
+            // The module's frame starts at the register holding its name.
+            materialize(rc, top);
+            emitWrite(rc, ROP_IMPORT, top, false);
+            break;
+        case OP_EXPORT: {
+            uint8_t value = readRegister(rc, top);
+            emitOperand(rc, ROP_EXPORT);
+            emitByte(rc, value);
+            emitByte(rc, operands[0]);
+            break;
+        }
+        default:
+            return -1;
+    }
+
+    return next;
+}
+
+// Frees the buffers that are only needed during translation.
+static void freeScratch(RegisterCompiler* rc) {
+    int count = rc->source->count;
+    if (rc->targetDepths != NULL) FREE_ARRAY(int, rc->targetDepths, count + 1);
+    if (rc->newOffsets != NULL) FREE_ARRAY(int, rc->newOffsets, count + 1);
+    if (rc->jumps != NULL) FREE_ARRAY(RegisterJump, rc->jumps, count);
+    rc->targetDepths = NULL;
+    rc->newOffsets = NULL;
+    rc->jumps = NULL;
+}
+
+void abandonRegisterCompilation() {
+    if (translation.source == NULL) return;
+    freeScratch(&translation);
+    freeChunk(&translation.code);
+    translation.source = NULL;
+}
+
+bool compileRegisters(ObjFunction* function) {
+    Chunk* source = &function->chunk;
+
+    RegisterCompiler* rc = &translation;
+    rc->source = source;
+    initChunk(&rc->code);
+    rc->line = 0;
+    rc->depth = 0;
+    rc->registerCount = 0;
+    rc->lastDestination = -1;
+    rc->targetDepths = ALLOCATE(int, source->count + 1);
+    rc->newOffsets = ALLOCATE(int, source->count + 1);
+    rc->jumps = ALLOCATE(RegisterJump, source->count);
+    rc->jumpCount = 0;
+    rc->tooManyRegisters = false;
+
+    for (int i = 0; i <= function->arity; i++) {
+        pushOperand(rc, OPERAND_REGISTER, 0);
+    }
+    findTargetDepths(rc, function->arity);
+
+    bool reachable = true;
+    bool translated = true;
+    for (int offset = 0; offset < source->count;) {
+        rc->line = getLine(source, offset);
+        if (rc->targetDepths[offset] != -1) {
+            if (reachable) materializeRange(rc, 0, rc->depth);
+            rc->depth = rc->targetDepths[offset];
+            for (int reg = 0; reg < rc->depth; reg++) {
+                rc->stack[reg].kind = OPERAND_REGISTER;
+            }
+            rc->lastDestination = -1;
+        }
+        rc->newOffsets[offset] = rc->code.count;
+
+        uint8_t instruction = source->code[offset];
+        offset = translate(rc, offset);
+        if (offset == -1 || rc->tooManyRegisters) {
+            translated = false;
+            break;
+        }
+        reachable = !isUnconditional(instruction);
+    }
+    rc->newOffsets[source->count] = rc->code.count;
+
+    for (int i = 0; translated && i < rc->jumpCount; i++) {
+        RegisterJump* jump = &rc->jumps[i];
+        int distance = jump->sign * (rc->newOffsets[jump->target] - jump->from);
+        if (distance < 0 || distance > UINT16_MAX) {
+            translated = false;
+            break;
+        }
+        rc->code.code[jump->operand] = (distance >> 8) & 0xff;
+        rc->code.code[jump->operand + 1] = distance & 0xff;
+    }
+
+    freeScratch(rc);
+    rc->source = NULL;
+
+    if (!translated) {
+        freeChunk(&rc->code);
+        return false;
+    }
+
+    // Keep the constants; swap in the register code and its line table.
+    replaceCode(source, &rc->code);
+    function->registerCount = rc->registerCount;
+    return true;
+}
@@ -6,109 +6,375 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef FLS_SSE2
+#include <emmintrin.h>
+#endif
+
+// Control bytes. Both special values have the high bit set, so they never
+// equal the seven-bit hash fragment a full slot holds.
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+// Slots whose control bytes one probe step compares at once.
+#define GROUP_WIDTH 16
+
+// The low seven bits of a hash go in the control byte; the rest pick the
+// group the probe starts at.
+#define HASH_FRAGMENT(hash) ((int8_t)((hash) & 0x7f))
+#define HASH_GROUP(hash) ((hash) >> 7)
+
+// Resize once the entries array holds seven eighths as many entries, live
+// or deleted, as there are slots. Every full or deleted slot has an entry,
+// so there is always an empty slot left and every probe ends.
+#define TABLE_MAX_LOAD_NUMERATOR 7
+#define TABLE_MAX_LOAD_DENOMINATOR 8
+
+// Shrink once fewer than one slot in eight is full.
+#define TABLE_MIN_LOAD_DENOMINATOR 8
+
+// One bit per slot of a group, set for the slots a match selects.
+typedef uint32_t GroupMask;
+
+#ifdef FLS_SSE2
+
+static inline GroupMask matchByte(const int8_t* group, int8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+}
+
+static inline GroupMask matchEmptyOrDeleted(const int8_t* group) {
+    // Only the special values have the high bit set.
+    return (GroupMask)_mm_movemask_epi8(
+        _mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+// Without SSE2, a group is compared as two 64-bit words, eight control bytes
+// at a time.
+#define LOW_BITS 0x0101010101010101ull
+#define HIGH_BITS 0x8080808080808080ull
+
+// Loads eight control bytes with the first in the low byte of the word.
+static inline uint64_t loadWord(const int8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Gathers the high bit of each byte of 'word' into the low eight bits. The
+// multiplication moves each bit to its own place, so no two of them carry.
+static inline GroupMask packHighBits(uint64_t word) {
+    return (GroupMask)((((word & HIGH_BITS) >> 7) * 0x0102040810204080ull) >> 56);
+}
+
+// Sets the high bit of exactly the bytes of 'word' that are zero.
+static inline uint64_t zeroBytes(uint64_t word) {
+    return ~(((word & ~HIGH_BITS) + ~HIGH_BITS) | word) & HIGH_BITS;
+}
+
+static inline GroupMask matchByte(const int8_t* group, int8_t byte) {
+    uint64_t pattern = LOW_BITS * (uint8_t)byte;
+    return packHighBits(zeroBytes(loadWord(group) ^ pattern)) |
+           packHighBits(zeroBytes(loadWord(group + 8) ^ pattern)) << 8;
+}
+
+static inline GroupMask matchEmptyOrDeleted(const int8_t* group) {
+    // Only the special values have the high bit set.
+    return packHighBits(loadWord(group)) | packHighBits(loadWord(group + 8)) << 8;
+}
+
+#endif
+
+static inline GroupMask matchEmpty(const int8_t* group) {
+    return matchByte(group, CONTROL_EMPTY);
+}
+
+// Walks a probe sequence: group after group, with the step growing by one
+// group each time. The number of groups is a power of two, so the sequence
+// visits every group.
+typedef struct {
+    uint32_t mask;
+    uint32_t group;
+    uint32_t step;
+} Probe;
+
+static inline Probe startProbe(int capacity, uint32_t hash) {
+    Probe probe;
+    probe.mask = (uint32_t)(capacity / GROUP_WIDTH) - 1;
+    probe.group = HASH_GROUP(hash) & probe.mask;
+    probe.step = 0;
+    return probe;
+}
+
+static inline void nextGroup(Probe* probe) {
+    probe->step++;
+    probe->group = (probe->group + probe->step) & probe->mask;
+}
+
+static inline int firstSlot(GroupMask mask) {
+    return __builtin_ctz(mask);
+}
+
+// Scrambles the bits of a key that is not a string, so that keys differing
+// only in their high bits still spread over the groups and fragments.
+static inline uint32_t mixHash(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static uint32_t hashKey(Value key) {
+    if (IS_OBJ(key)) return stringHash((ObjString*)AS_OBJ(key));
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        // Integer keys, such as IDs and counters, hash their value rather
+        // than the bits of the double.
+        if (number >= INT32_MIN && number <= INT32_MAX &&
+            number == (int32_t)number) {
+            return mixHash((uint32_t)(int32_t)number);
+        }
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return mixHash((uint32_t)(bits ^ (bits >> 32)));
+    }
+    if (IS_BOOL(key)) return AS_BOOL(key) ? 0x9e3779b9 : 0x7f4a7c15;
+    return 0x165667b1;
+}
+
+static inline bool keysEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Stored numbers are never -0 or NaN, so equal numbers have equal bits.
+    if (a == b) return true;
+    // Only a string too long to be interned can match one that is not the
+    // same object.
+    return IS_OBJ(a) && IS_OBJ(b) &&
+           stringsEqual((ObjString*)AS_OBJ(a), (ObjString*)AS_OBJ(b));
+#else
+    return valuesEqual(a, b);
+#endif
+}
 
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
+    table->control = NULL;
+    table->index = NULL;
+    table->entryCount = 0;
+    table->entryCapacity = 0;
     table->entries = NULL;
 }
 
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(int8_t, table->control, table->capacity);
+    FREE_ARRAY(int32_t, table->index, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->entryCapacity);
     initTable(table);
 }
 
-// The core function for finding an entry in the hash table.
-// It uses linear probing to resolve collisions.
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
+// Returns the slot holding 'key', or -1 if the table has none.
+static int findSlot(Table* table, Value key) {
+    if (table->count == 0) return -1;
+
+    uint32_t hash = hashKey(key);
+    int8_t fragment = HASH_FRAGMENT(hash);
+    for (Probe probe = startProbe(table->capacity, hash);;
+         nextGroup(&probe)) {
+        int base = probe.group * GROUP_WIDTH;
+        const int8_t* group = &table->control[base];
+        for (GroupMask matches = matchByte(group, fragment); matches != 0;
+             matches &= matches - 1) {
+            int slot = base + firstSlot(matches);
+            if (keysEqual(key, table->entries[table->index[slot]].key)) {
+                return slot;
             }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
         }
-
-        index = (index + 1) % capacity;
+        if (matchEmpty(group) != 0) return -1;
     }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
-    if (table->count == 0) return false;
+// Returns the first empty or deleted slot on the probe sequence for 'hash'.
+static int findFreeSlot(int8_t* control, int capacity, uint32_t hash) {
+    for (Probe probe = startProbe(capacity, hash);; nextGroup(&probe)) {
+        int base = probe.group * GROUP_WIDTH;
+        GroupMask free = matchEmptyOrDeleted(&control[base]);
+        if (free != 0) return base + firstSlot(free);
+    }
+}
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+bool tableGetValue(Table* table, Value key, Value* value) {
+    int slot = findSlot(table, key);
+    if (slot == -1) return false;
 
-    *value = entry->value;
+    *value = table->entries[table->index[slot]].value;
     return true;
 }
 
+// The most entries, live or deleted, an index of 'capacity' slots takes.
+static int maxEntries(int capacity) {
+    return capacity / TABLE_MAX_LOAD_DENOMINATOR * TABLE_MAX_LOAD_NUMERATOR;
+}
+
+// Returns the capacity to rehash 'count' entries into: enough that they fill
+// under half the maximum load, leaving room to insert or delete a good many
+// before the next resize.
+static int capacityFor(int count) {
+    int capacity = GROUP_WIDTH;
+    while (count * 2 > maxEntries(capacity)) capacity *= 2;
+    return capacity;
+}
+
+// Builds a fresh index of 'capacity' slots, which may be more, fewer or the
+// same as before. The live entries move to the front of the entries array,
+// keeping their order, so the deleted ones are dropped.
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    int8_t* control = ALLOCATE(int8_t, capacity);
+    int32_t* index = ALLOCATE(int32_t, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
+    int live = 0;
+    for (int i = 0; i < table->entryCount; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (IS_UNDEFINED(entry->key)) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        uint32_t hash = hashKey(entry->key);
+        int slot = findFreeSlot(control, capacity, hash);
+        control[slot] = HASH_FRAGMENT(hash);
+        index[slot] = live;
+        table->entries[live++] = *entry;
     }
+    table->entryCount = live;
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
+    FREE_ARRAY(int8_t, table->control, table->capacity);
+    FREE_ARRAY(int32_t, table->index, table->capacity);
+    table->control = control;
+    table->index = index;
     table->capacity = capacity;
+
+    // Give back the entries a smaller index can no longer use.
+    if (table->entryCapacity > maxEntries(capacity)) {
+        table->entries = GROW_ARRAY(Entry, table->entries,
+                                    table->entryCapacity, maxEntries(capacity));
+        table->entryCapacity = maxEntries(capacity);
+    }
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+bool tableSetValue(Table* table, Value key, Value value) {
+    int slot = findSlot(table, key);
+    if (slot != -1) {
+        table->entries[table->index[slot]].value = value;
+        return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    if (table->entryCount + 1 > maxEntries(table->capacity)) {
+        // Sized by the live entries alone, so a table that is mostly deleted
+        // entries is compacted at the same size rather than doubled.
+        adjustCapacity(table, capacityFor(table->count));
+    }
+    if (table->entryCount + 1 > table->entryCapacity) {
+        // The entries array grows on its own, up to what the index takes,
+        // so it is only as large as the entries need.
+        int entryCapacity = GROW_CAPACITY(table->entryCapacity);
+        if (entryCapacity > maxEntries(table->capacity)) {
+            entryCapacity = maxEntries(table->capacity);
+        }
+        table->entries = GROW_ARRAY(Entry, table->entries,
+                                    table->entryCapacity, entryCapacity);
+        table->entryCapacity = entryCapacity;
+    }
 
+    uint32_t hash = hashKey(key);
+    slot = findFreeSlot(table->control, table->capacity, hash);
+    table->control[slot] = HASH_FRAGMENT(hash);
+    table->index[slot] = table->entryCount;
+
+    Entry* entry = &table->entries[table->entryCount++];
     entry->key = key;
     entry->value = value;
-    return isNewKey;
+    table->count++;
+    return true;
 }
 
-bool tableDelete(Table* table, ObjString* key) {
-    if (table->count == 0) return false;
+static void removeEntry(Table* table, int slot) {
+    // A probe stops at the first group with an empty slot, so no probe
+    // passes through such a group and the slot can simply be emptied.
+    // Otherwise mark it deleted, so probes for keys placed after it keep
+    // going.
+    const int8_t* group = &table->control[slot & ~(GROUP_WIDTH - 1)];
+    bool emptied = matchEmpty(group) != 0;
+    table->control[slot] = emptied ? CONTROL_EMPTY : CONTROL_DELETED;
+    table->count--;
+
+    // The entry stays behind as a deleted one until the next resize, unless
+    // it was the last one appended and its slot is empty again. A deleted
+    // slot must keep its entry so that it counts toward the load.
+    int position = table->index[slot];
+    if (emptied && position == table->entryCount - 1) {
+        table->entryCount--;
+    } else {
+        table->entries[position].key = UNDEFINED_VAL;
+        table->entries[position].value = NIL_VAL;
+    }
+}
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+static bool deleteEntry(Table* table, Value key) {
+    int slot = findSlot(table, key);
+    if (slot == -1) return false;
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    removeEntry(table, slot);
+    return true;
+}
+
+bool tableDeleteValue(Table* table, Value key) {
+    if (!deleteEntry(table, key)) return false;
+
+    if (table->capacity > GROUP_WIDTH &&
+        table->count * TABLE_MIN_LOAD_DENOMINATOR < table->capacity) {
+        adjustCapacity(table, capacityFor(table->count));
+    }
     return true;
 }
 
+bool tableGet(Table* table, ObjString* key, Value* value) {
+    return tableGetValue(table, OBJ_VAL(key), value);
+}
+
+bool tableSet(Table* table, ObjString* key, Value value) {
+    return tableSetValue(table, OBJ_VAL(key), value);
+}
+
+bool tableDelete(Table* table, ObjString* key) {
+    return tableDeleteValue(table, OBJ_VAL(key));
+}
+
+bool tableDeleteNoShrink(Table* table, ObjString* key) {
+    return deleteEntry(table, OBJ_VAL(key));
+}
+
+Value tableKey(Value key) {
+    if (IS_STRING(key)) return OBJ_VAL(AS_STRING(key));
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        if (number != number) return UNDEFINED_VAL;  // NaN equals nothing.
+        // -0 equals 0, so it has to find the same entry.
+        return number == 0 ? NUMBER_VAL(0) : key;
+    }
+    if (IS_NIL(key) || IS_BOOL(key)) return key;
+    return UNDEFINED_VAL;
+}
+
 void tableAddAll(Table* from, Table* to) {
-    for (int i = 0; i < from->capacity; i++) {
+    for (int i = 0; i < from->entryCount; i++) {
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (!IS_UNDEFINED(entry->key)) {
+            tableSetValue(to, entry->key, entry->value);
         }
     }
 }
@@ -116,19 +382,41 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
+    int8_t fragment = HASH_FRAGMENT(hash);
+    for (Probe probe = startProbe(table->capacity, hash);;
+         nextGroup(&probe)) {
+        int base = probe.group * GROUP_WIDTH;
+        const int8_t* group = &table->control[base];
+        for (GroupMask matches = matchByte(group, fragment); matches != 0;
+             matches &= matches - 1) {
+            int slot = base + firstSlot(matches);
+            Value entryKey = table->entries[table->index[slot]].key;
+            if (!IS_OBJ(entryKey)) continue;
+            ObjString* key = (ObjString*)AS_OBJ(entryKey);
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
+        // Stop at the first group with an empty slot.
+        if (matchEmpty(group) != 0) return NULL;
+    }
+}
 
-        index = (index + 1) % table->capacity;
+void markTable(Table* table) {
+    for (int i = 0; i < table->entryCount; i++) {
+        Entry* entry = &table->entries[i];
+        markValue(entry->key);
+        markValue(entry->value);
+    }
+}
+
+void tableRemoveWhite(Table* table) {
+    for (int slot = 0; slot < table->capacity; slot++) {
+        if (table->control[slot] < 0) continue;
+        Value key = table->entries[table->index[slot]].key;
+        if (IS_OBJ(key) && !AS_OBJ(key)->isMarked) {
+            removeEntry(table, slot);
+        }
     }
 }
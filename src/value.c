@@ -15,10 +15,12 @@ void initValueArray(ValueArray* array) {
 // Writes a value to a value array.
 void writeValueArray(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
-        int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
+        // The capacity is only updated once the array has grown, so that
+        // running out of memory leaves the array as it was.
+        int capacity = GROW_CAPACITY(array->capacity);
         array->values = GROW_ARRAY(Value, array->values,
-                                   oldCapacity, array->capacity);
+                                   array->capacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -58,6 +60,17 @@ Value removeValueArray(ValueArray* array, int index) {
 
 // Prints a value.
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -65,17 +78,34 @@ void printValue(Value value) {
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
+        case VAL_UNDEFINED: printf("undefined"); break;
     }
+#endif
 }
 
 // Checks if two values are equal.
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Identical bits mean equal values, except for NaN itself which must
+    // compare unequal, so numbers still go through a double comparison.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return IS_STRING(a) && IS_STRING(b) &&
+           stringsEqual(AS_STRING(a), AS_STRING(b));
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return IS_STRING(a) && IS_STRING(b) &&
+                   stringsEqual(AS_STRING(a), AS_STRING(b));
+        case VAL_UNDEFINED: return true;
         default:         return false; // Unreachable.
     }
+#endif
 }
@@ -27,6 +27,7 @@ double fmod(double x, double y);
 #include "compiler.h"
 #include "debug.h"
 #include "error.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -73,8 +74,7 @@ static Value stringLengthNative(int argCount, Value* args) {
     return NIL_VAL;
   }
 
-  ObjString* string = AS_STRING(args[0]);
-  return NUMBER_VAL(string->length);
+  return NUMBER_VAL(stringLength(AS_OBJ(args[0])));
 }
 
 // Native 'toString' function: converts a number to a string.
@@ -154,7 +154,7 @@ static Value listLenNative(int argCount, Value* args) {
   }
 
   ObjList* list = AS_LIST(args[0]);
-  return NUMBER_VAL(list->items->count);
+  return NUMBER_VAL(list->items.count);
 }
 
 // Native 'listGet' function: returns the item at a given index in a list.
@@ -177,12 +177,12 @@ static Value listGetNative(int argCount, Value* args) {
   ObjList* list = AS_LIST(args[0]);
   int index = AS_NUMBER(args[1]);
 
-  if (index < 0 || index >= list->items->count) {
+  if (index < 0 || index >= list->items.count) {
     runtimeError("listGet() index out of bounds.");
     return NIL_VAL;
   }
 
-  return list->items->values[index];
+  return list->items.values[index];
 }
 
 // Native 'listSet' function: sets the item at a given index in a list.
@@ -205,12 +205,13 @@ static Value listSetNative(int argCount, Value* args) {
   ObjList* list = AS_LIST(args[0]);
   int index = AS_NUMBER(args[1]);
 
-  if (index < 0 || index >= list->items->count) {
+  if (index < 0 || index >= list->items.count) {
     runtimeError("listSet() index out of bounds.");
     return NIL_VAL;
   }
 
-  list->items->values[index] = args[2];
+  list->items.values[index] = args[2];
+  writeBarrier((Obj*)list, args[2]);
   return args[2];
 }
 
@@ -226,7 +227,8 @@ static Value listPushNative(int argCount, Value* args) {
     }
 
     ObjList* list = AS_LIST(args[0]);
-    writeValueArray(list->items, args[1]);
+    listAppend(list, args[1]);
+    writeBarrier((Obj*)list, args[1]);
     return args[1];
 }
 
@@ -242,12 +244,12 @@ static Value listPopNative(int argCount, Value* args) {
     }
 
     ObjList* list = AS_LIST(args[0]);
-    if (list->items->count == 0) {
+    if (list->items.count == 0) {
         runtimeError("listPop() called on an empty list.");
         return NIL_VAL;
     }
 
-    return popValueArray(list->items);
+    return popValueArray(&list->items);
 }
 
 // Native 'listClear' function: removes all items from a list.
@@ -262,7 +264,7 @@ static Value listClearNative(int argCount, Value* args) {
     }
 
     ObjList* list = AS_LIST(args[0]);
-    freeValueArray(list->items);
+    listClear(list);
     
     return NIL_VAL;
 }
@@ -279,12 +281,29 @@ static Value listShiftNative(int argCount, Value* args) {
     }
 
     ObjList* list = AS_LIST(args[0]);
-    if (list->items->count == 0) {
+    if (list->items.count == 0) {
         runtimeError("listShift() called on an empty list.");
         return NIL_VAL;
     }
 
-    return removeValueArray(list->items, 0);
+    return listShift(list);
+}
+
+// Native 'listUnshift' function: inserts an item at the front of a list.
+static Value listUnshiftNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("listUnshift() takes exactly 2 arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+    if (!IS_LIST(args[0])) {
+        runtimeError("listUnshift() first argument must be a list.");
+        return NIL_VAL;
+    }
+
+    ObjList* list = AS_LIST(args[0]);
+    listPrepend(list, args[1]);
+    writeBarrier((Obj*)list, args[1]);
+    return args[1];
 }
 
 // Native 'endsWith' function: checks if a string ends with a given suffix.
@@ -381,13 +400,12 @@ static Value toUpperCaseNative(int argCount, Value* args) {
   }
 
   ObjString* string = AS_STRING(args[0]);
-  char* newChars = ALLOCATE(char, string->length + 1);
+  ObjString* result = reserveString(string->length);
   for (int i = 0; i < string->length; i++) {
-    newChars[i] = toupper(string->chars[i]);
+    result->chars[i] = toupper(string->chars[i]);
   }
-  newChars[string->length] = '\0';
 
-  return OBJ_VAL(takeString(newChars, string->length));
+  return OBJ_VAL(takeString(result));
 }
 
 // Native 'toLowerCase' function: converts a string to lowercase.
@@ -402,13 +420,12 @@ static Value toLowerCaseNative(int argCount, Value* args) {
   }
 
   ObjString* string = AS_STRING(args[0]);
-  char* newChars = ALLOCATE(char, string->length + 1);
+  ObjString* result = reserveString(string->length);
   for (int i = 0; i < string->length; i++) {
-    newChars[i] = tolower(string->chars[i]);
+    result->chars[i] = tolower(string->chars[i]);
   }
-  newChars[string->length] = '\0';
 
-  return OBJ_VAL(takeString(newChars, string->length));
+  return OBJ_VAL(takeString(result));
 }
 
 static Value mapSetNative(int argCount, Value* args) {
@@ -420,16 +437,18 @@ static Value mapSetNative(int argCount, Value* args) {
         runtimeError("First argument to mapSet() must be a map.");
         return NIL_VAL;
     }
-    if (!IS_STRING(args[1])) {
-        runtimeError("Second argument (key) to mapSet() must be a string.");
+    Value key = tableKey(args[1]);
+    if (IS_UNDEFINED(key)) {
+        runtimeError("Second argument (key) to mapSet() must be nil, a bool, a string or a number other than NaN.");
         return NIL_VAL;
     }
 
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
     Value value = args[2];
 
-    tableSet(&map->table, key, value);
+    tableSetValue(&map->table, key, value);
+    writeBarrier((Obj*)map, key);
+    writeBarrier((Obj*)map, value);
     return value;
 }
 
@@ -442,16 +461,16 @@ static Value mapGetNative(int argCount, Value* args) {
         runtimeError("First argument to mapGet() must be a map.");
         return NIL_VAL;
     }
-    if (!IS_STRING(args[1])) {
-        runtimeError("Second argument (key) to mapGet() must be a string.");
+    Value key = tableKey(args[1]);
+    if (IS_UNDEFINED(key)) {
+        runtimeError("Second argument (key) to mapGet() must be nil, a bool, a string or a number other than NaN.");
         return NIL_VAL;
     }
 
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
     Value value;
 
-    if (!tableGet(&map->table, key, &value)) {
+    if (!tableGetValue(&map->table, key, &value)) {
         return NIL_VAL;
     }
 
@@ -467,21 +486,79 @@ static Value mapDeleteNative(int argCount, Value* args) {
         runtimeError("First argument to mapDelete() must be a map.");
         return NIL_VAL;
     }
-    if (!IS_STRING(args[1])) {
-        runtimeError("Second argument (key) to mapDelete() must be a string.");
+    Value key = tableKey(args[1]);
+    if (IS_UNDEFINED(key)) {
+        runtimeError("Second argument (key) to mapDelete() must be nil, a bool, a string or a number other than NaN.");
         return NIL_VAL;
     }
 
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
 
-    if (tableDelete(&map->table, key)) {
+    if (tableDeleteValue(&map->table, key)) {
         return BOOL_VAL(true);
     }
 
     return BOOL_VAL(false);
 }
 
+static void setStat(ObjMap* map, const char* name, double value) {
+    ObjString* key = copyString(name, (int)strlen(name));
+    push(OBJ_VAL(key));
+    tableSet(&map->table, key, NUMBER_VAL(value));
+    writeBarrier((Obj*)map, OBJ_VAL(key));
+    pop();
+}
+
+// Native 'gcStats' function: returns a map of collector statistics, with
+// times in milliseconds.
+static Value gcStatsNative(int argCount, Value* args) {
+    (void)args; // Unused.
+    if (argCount != 0) {
+        runtimeError("gcStats() takes no arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    // Building the map may collect, so take the numbers first.
+    GcStats stats = vm.gcStats;
+    size_t bytesAllocated = vm.bytesAllocated;
+
+    ObjMap* map = newMap();
+    push(OBJ_VAL(map));
+    setStat(map, "minorCollections", (double)stats.minorCollections);
+    setStat(map, "fullCollections", (double)stats.fullCollections);
+    setStat(map, "minorPauseTotal", stats.minorPauseTime / 1e6);
+    setStat(map, "minorPauseMax", stats.maxMinorPause / 1e6);
+    setStat(map, "fullPauseTotal", stats.fullPauseTime / 1e6);
+    setStat(map, "fullPauseMax", stats.maxFullPause / 1e6);
+    setStat(map, "sweepWait", stats.sweepWaitTime / 1e6);
+    setStat(map, "bytesFreed", (double)stats.bytesFreed);
+    setStat(map, "bytesAllocated", (double)bytesAllocated);
+    pop();
+    return OBJ_VAL(map);
+}
+
+// Native 'memoryUsage' function: the heap's current and peak size in bytes,
+// and its limits, which are 0 when unset.
+static Value memoryUsageNative(int argCount, Value* args) {
+    (void)args; // Unused.
+    if (argCount != 0) {
+        runtimeError("memoryUsage() takes no arguments (%d given).", argCount);
+        return NIL_VAL;
+    }
+
+    size_t current = vm.bytesAllocated;
+    size_t peak = vm.peakBytes;
+
+    ObjMap* map = newMap();
+    push(OBJ_VAL(map));
+    setStat(map, "current", (double)current);
+    setStat(map, "peak", (double)peak);
+    setStat(map, "softLimit", (double)vm.softLimit);
+    setStat(map, "hardLimit", (double)vm.hardLimit);
+    pop();
+    return OBJ_VAL(map);
+}
+
 VM vm;
 
 // Forward declaration for the runtime error function.
@@ -557,7 +634,10 @@ static void walk(const char* dir, ObjList* list) {
             // To add recursion, we would call walk(path, list) here.
         } else {
             Value pathValue = OBJ_VAL(copyString(dp->d_name, strlen(dp->d_name)));
-            writeValueArray(list->items, pathValue);
+            push(pathValue); // Growing the list may collect.
+            listAppend(list, pathValue);
+            writeBarrier((Obj*)list, pathValue);
+            pop();
         }
     }
     closedir(dfd);
@@ -736,8 +816,8 @@ static void* worker(void* arg) {
 
 static bool isPathExcluded(const char* path, ObjList* excluded_dirs) {
     if (excluded_dirs == NULL) return false;
-    for (int i = 0; i < excluded_dirs->items->count; i++) {
-        Value excluded_val = excluded_dirs->items->values[i];
+    for (int i = 0; i < excluded_dirs->items.count; i++) {
+        Value excluded_val = excluded_dirs->items.values[i];
         if (IS_STRING(excluded_val)) {
             const char* excluded_path = AS_CSTRING(excluded_val);
             size_t excluded_len = strlen(excluded_path);
@@ -946,16 +1026,16 @@ static Value analyzeNative(int argCount, Value* args) {
 
     ObjList* resultList = newList();
     push(OBJ_VAL(resultList));
-    writeValueArray(resultList->items, NUMBER_VAL((double)total_files));
-    writeValueArray(resultList->items, NUMBER_VAL((double)total_lines));
-    writeValueArray(resultList->items, NUMBER_VAL((double)total_chars));
+    listAppend(resultList, NUMBER_VAL((double)total_files));
+    listAppend(resultList, NUMBER_VAL((double)total_lines));
+    listAppend(resultList, NUMBER_VAL((double)total_chars));
     pop();
     return OBJ_VAL(resultList);
 }
 
 // Helper to check if a file has a valid extension.
 bool hasValidExtension(const char* filename, ObjList* extensions) {
-    if (extensions == NULL || extensions->items->count == 0) {
+    if (extensions == NULL || extensions->items.count == 0) {
         return true; // No extensions to check against, so all files are valid
     }
 
@@ -964,8 +1044,8 @@ bool hasValidExtension(const char* filename, ObjList* extensions) {
         return false; // No extension
     }
 
-    for (int i = 0; i < extensions->items->count; i++) {
-        Value extVal = extensions->items->values[i];
+    for (int i = 0; i < extensions->items.count; i++) {
+        Value extVal = extensions->items.values[i];
         if (!IS_STRING(extVal)) continue;
         
         ObjString* ext = AS_STRING(extVal);
@@ -989,19 +1069,52 @@ void resetStack() {
 // We keep the declaration here to avoid modifying all native function calls.
 void runtimeError(const char* format, ...);
 
+// Returns the index of the global variable 'name' in vm.globalValues,
+// allocating an undefined slot the first time the name is seen. The compiler
+// calls this to resolve global accesses to indexed instructions.
+int globalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globals, name, &slot)) return (int)AS_NUMBER(slot);
+
+  push(OBJ_VAL(name));
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globals, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
+// Looks up a global by name. Returns false if it has not been defined.
+bool getGlobal(ObjString* name, Value* value) {
+  Value slot;
+  if (!tableGet(&vm.globals, name, &slot)) return false;
+
+  *value = vm.globalValues.values[(int)AS_NUMBER(slot)];
+  return !IS_UNDEFINED(*value);
+}
+
+// Defines or overwrites a global by name.
+void setGlobal(ObjString* name, Value value) {
+  int slot = globalSlot(name);
+  vm.globalValues.values[slot] = value;
+}
+
 void defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  setGlobal(AS_STRING(vm.stackTop[-2]), vm.stackTop[-1]);
 
   pop();
   pop();
 }
 
 void defineGlobal(const char* name, Value value) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  // The value goes on the stack first, so that it is not collected while
+  // the name is allocated.
   push(value);
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  push(OBJ_VAL(copyString(name, (int)strlen(name))));
+  setGlobal(AS_STRING(vm.stackTop[-1]), vm.stackTop[-2]);
   pop();
   pop();
 }
@@ -1010,11 +1123,34 @@ void initVM() {
   vm.frameCount = 0;
   vm.stackTop = vm.stack;
   vm.objects = NULL;
+  vm.nursery = NULL;
+  vm.bytesAllocated = 0;
+  vm.nextGC = 1024 * 1024;
+  vm.youngBytes = 0;
+  vm.peakBytes = 0;
+  vm.softLimit = 0;
+  vm.hardLimit = 0;
+  vm.errorJump = NULL;
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+  memset(&vm.gcStats, 0, sizeof(vm.gcStats));
   vm.hadError = false;
+  vm.backend = BACKEND_STACK;
   initTable(&vm.globals);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
   initTable(&vm.modules);
   initTable(&vm.strings);
 
+#ifdef DEBUG_PROFILE_OPCODES
+  // Scripts that hit a runtime error exit without reaching freeVM().
+  atexit(printOpcodeProfile);
+#endif
+
   // Define all native functions.
   defineNative("clock", clockNative);
   defineNative("input", inputNative);
@@ -1039,6 +1175,12 @@ void initVM() {
   defineNative("dictGet", dictGetNative);
   defineNative("dictDelete", dictDeleteNative);
   defineNative("dictExists", dictExistsNative);
+  defineNative("dictKeys", dictKeysNative);
+  defineNative("dictValues", dictValuesNative);
+  defineNative("dictEntries", dictEntriesNative);
+  defineNative("dictNext", dictNextNative);
+  defineNative("dictKeyAt", dictKeyAtNative);
+  defineNative("dictValueAt", dictValueAtNative);
   defineNative("lines", countLinesNative);
   defineNative("listLen", listLenNative);
   defineNative("listGet", listGetNative);
@@ -1047,12 +1189,15 @@ void initVM() {
   defineNative("listPop", listPopNative);
   defineNative("listClear", listClearNative);
   defineNative("listShift", listShiftNative);
+  defineNative("listUnshift", listUnshiftNative);
   defineNative("endsWith", endsWithNative);
   defineNative("toNum", toNumNative);
   defineNative("map", mapNative);
   defineNative("mapSet", mapSetNative);
   defineNative("mapGet", mapGetNative);
   defineNative("mapDelete", mapDeleteNative);
+  defineNative("gcStats", gcStatsNative);
+  defineNative("memoryUsage", memoryUsageNative);
   defineNative("analyze", analyzeNative);
   defineNative("system", systemNative);
 
@@ -1080,10 +1225,19 @@ void initVM() {
 
   initMathLibrary();
   initRandomLibrary();
+
+  // Lets scripts such as the benchmarks report which interpreter loop ran.
+#ifdef FLS_COMPUTED_GOTO
+  defineGlobal("VM_DISPATCH", OBJ_VAL(copyString("computed-goto", 13)));
+#else
+  defineGlobal("VM_DISPATCH", OBJ_VAL(copyString("switch", 6)));
+#endif
 }
 
 void freeVM() {
   freeTable(&vm.globals);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   freeTable(&vm.modules);
   freeTable(&vm.strings);
   freeObjects();
@@ -1110,16 +1264,7 @@ static bool isFalsey(Value value) {
 }
 
 static void concatenate() {
-  ObjString* b = AS_STRING(peek(0));
-  ObjString* a = AS_STRING(peek(1));
-
-  int length = a->length + b->length;
-  char* chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  ObjString* result = takeString(chars, length);
+  Obj* result = concatenateStrings(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
   pop();
   pop();
   push(OBJ_VAL(result));
@@ -1137,6 +1282,10 @@ static bool call(ObjFunction* function, int argCount) {
     return false;
   }
 
+#ifdef FLS_JIT
+  if (vm.backend == BACKEND_STACK) jitCountHotness(function);
+#endif
+
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->function = function;
   frame->ip = function->chunk.code;
@@ -1144,6 +1293,28 @@ static bool call(ObjFunction* function, int argCount) {
   return true;
 }
 
+// Replaces the current frame with a call to 'function', whose callee slot and
+// arguments start at 'args'. They slide down over the caller's slots, so
+// tail-recursive code runs in constant stack.
+static bool tailCall(ObjFunction* function, int argCount, Value* args) {
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.", function->arity,
+                 argCount);
+    return false;
+  }
+
+#ifdef FLS_JIT
+  if (vm.backend == BACKEND_STACK) jitCountHotness(function);
+#endif
+
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->function = function;
+  frame->ip = function->chunk.code;
+  return true;
+}
+
 static bool callValue(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
@@ -1165,353 +1336,1282 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+// Imports the module named by the string on top of the stack, replacing the
+// name with the module. The first import of a module compiles it and pushes
+// a frame to run it, so callers must reload their current frame afterwards.
+static InterpretResult importModule() {
+  // The name stays on the stack while the module is compiled.
+  ObjString* moduleName = AS_STRING(peek(0));
+  Value moduleValue;
+
+  if (tableGet(&vm.modules, moduleName, &moduleValue)) {
+    vm.stackTop[-1] = moduleValue;
+  } else {
+    if (moduleName == NULL) {
+      runtimeError("Invalid module name.");
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    char* source = readFile(moduleName->chars);
+    if (source == NULL) {
+      runtimeError("Could not open module '%s'.", moduleName->chars);
+      return INTERPRET_RUNTIME_ERROR;
+    }
 
-#define READ_BYTE() (*frame->ip++)
+    ObjModule* module = newModule(moduleName);
+    push(OBJ_VAL(module));
+
+    tableSet(&vm.modules, moduleName, OBJ_VAL(module));
+
+    ObjFunction* func = compile(source, module);
+    free(source);
+
+    if (func == NULL) {
+      tableDelete(&vm.modules, moduleName);
+      pop(); // Pop the module.
+      return INTERPRET_COMPILE_ERROR;
+    }
+
+    // The module is on the stack. We pop it, replace the name with the
+    // function, and call it.
+    pop(); // Pop the module.
+    vm.stackTop[-1] = OBJ_VAL(func);
+    call(func, 0);
+
+    // The module has been executed. Now, copy its exported variables
+    // to the global scope.
+    for (int i = 0; i < module->variables.entryCount; i++) {
+      Entry* entry = &module->variables.entries[i];
+      if (!IS_UNDEFINED(entry->key)) {
+        setGlobal((ObjString*)AS_OBJ(entry->key), entry->value);
+      }
+    }
+
+    // The import statement leaves the module object on the stack.
+    vm.stackTop[-1] = OBJ_VAL(module);
+  }
+  return INTERPRET_OK;
+}
+
+static InterpretResult run() {
+  // The hot interpreter state lives in locals the C compiler can keep in
+  // registers: the current frame's ip and slots, and the stack top. While an
+  // instruction runs, frame->ip and vm.stackTop are stale. STORE_FRAME()
+  // writes them back before anything outside this loop can look at them:
+  // calls and natives, allocation, imports, native code and runtime errors.
+  // LOAD_FRAME() picks the state up again afterwards from whichever frame is
+  // then on top, since calls, returns and native code can all change it.
+  CallFrame* frame;
+  uint8_t* ip;
+  Value* slots;
+  Value* sp;
+
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = sp)
+#define LOAD_FRAME()                                                       \
+  (frame = &vm.frames[vm.frameCount - 1], ip = frame->ip,                  \
+   slots = frame->slots, sp = vm.stackTop)
+
+  LOAD_FRAME();
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+  (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
-#define BINARY_OP(valueType, op)                                           \
+// Rewrites the instruction being executed into another form of itself.
+#define QUICKEN(opcode) (ip[-1] = (opcode))
+
+// Restores the generic form of a quickened instruction whose guard failed and
+// rewinds ip so the next dispatch executes it.
+#define DEOPTIMIZE(opcode) (ip[-1] = (opcode), ip--)
+
+// Reports a runtime error at the instruction being executed.
+#define RUNTIME_ERROR(...)                                                 \
   do {                                                                     \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                       \
-      runtimeError("Operands must be numbers.");                           \
-      return INTERPRET_RUNTIME_ERROR;                                      \
+    STORE_FRAME();                                                         \
+    runtimeError(__VA_ARGS__);                                             \
+    return INTERPRET_RUNTIME_ERROR;                                        \
+  } while (false)
+
+#define BINARY_OP(valueType, op, quickOp)                                  \
+  do {                                                                     \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                      \
+      RUNTIME_ERROR("Operands must be numbers.");                          \
+    }                                                                      \
+    QUICKEN(quickOp);                                                      \
+    double b = AS_NUMBER(POP());                                           \
+    double a = AS_NUMBER(POP());                                           \
+    PUSH(valueType(a op b));                                               \
+  } while (false)
+
+#define QUICK_BINARY_OP(valueType, op, genericOp)                          \
+  do {                                                                     \
+    Value b = PEEK(0);                                                     \
+    Value a = PEEK(1);                                                     \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                  \
+      DEOPTIMIZE(genericOp);                                               \
+      break;                                                               \
+    }                                                                      \
+    sp--;                                                                  \
+    sp[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b));                      \
+  } while (false)
+
+// Shared by the fused additions: numbers take the fast path, anything else
+// goes through the same checks as OP_ADD.
+#define FUSED_ADD(a, b)                                                    \
+  do {                                                                     \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                    \
+      PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));                       \
+    } else if (IS_STRING(a) && IS_STRING(b)) {                             \
+      PUSH(a);                                                             \
+      PUSH(b);                                                             \
+      STORE_FRAME();                                                       \
+      concatenate();                                                       \
+      sp = vm.stackTop;                                                    \
+    } else {                                                               \
+      RUNTIME_ERROR("Operands must be two numbers or two strings.");       \
+    }                                                                      \
+  } while (false)
+
+// Shared by the fused `a < b; JUMP_IF_FALSE; POP` forms. When the test
+// passes, the condition the POP would discard is never pushed; when it
+// fails, false is left for the POP at the jump target.
+#define FUSED_LESS_JUMP(a, b)                                              \
+  do {                                                                     \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                  \
+      RUNTIME_ERROR("Operands must be numbers.");                          \
+    }                                                                      \
+    uint16_t offset = READ_SHORT();                                        \
+    if (!(AS_NUMBER(a) < AS_NUMBER(b))) {                                  \
+      PUSH(BOOL_VAL(false));                                               \
+      ip += offset;                                                        \
     }                                                                      \
-    double b = AS_NUMBER(pop());                                           \
-    double a = AS_NUMBER(pop());                                           \
-    push(valueType(a op b));                                               \
   } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->function->chunk,
-                           (int)(frame->ip - frame->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                \
+  do {                                                                     \
+    printf("          ");                                                  \
+    for (Value* slot = vm.stack; slot < sp; slot++) {                      \
+      printf("[ ");                                                        \
+      printValue(*slot);                                                   \
+      printf(" ]");                                                        \
+    }                                                                      \
+    printf("\n");                                                          \
+    disassembleInstruction(&frame->function->chunk,                        \
+                           (int)(ip - frame->function->chunk.code));       \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileOpcode(*ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+// Continues the current frame in native code once its function has been
+// compiled. The native code hands back the first instruction it leaves to
+// the interpreter, which the following dispatch executes.
+#ifdef FLS_JIT
+#define ENTER_JIT()                                                        \
+  do {                                                                     \
+    if (frame->function->jit != NULL) {                                    \
+      STORE_FRAME();                                                       \
+      jitExecute(frame);                                                   \
+      LOAD_FRAME();                                                        \
+    }                                                                      \
+  } while (false)
+#else
+#define ENTER_JIT() do { } while (false)
 #endif
 
-    uint8_t instruction;
+  uint8_t instruction;
+
+#ifdef FLS_COMPUTED_GOTO
+  // Direct-threaded dispatch: every handler ends by jumping straight to the
+  // handler of the next instruction, so each opcode gets its own indirect
+  // branch instead of all of them sharing the one at the top of a switch.
+  // Opcodes the VM does not implement yet trap.
+  static void* dispatchTable[] = {
+    [OP_CONSTANT]                 = &&op_OP_CONSTANT,
+    [OP_NIL]                      = &&op_OP_NIL,
+    [OP_TRUE]                     = &&op_OP_TRUE,
+    [OP_FALSE]                    = &&op_OP_FALSE,
+    [OP_POP]                      = &&op_OP_POP,
+    [OP_GET_LOCAL]                = &&op_OP_GET_LOCAL,
+    [OP_SET_LOCAL]                = &&op_OP_SET_LOCAL,
+    [OP_GET_GLOBAL]               = &&op_OP_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL]            = &&op_OP_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL]               = &&op_OP_SET_GLOBAL,
+    [OP_GET_GLOBAL_SLOT]          = &&op_OP_GET_GLOBAL_SLOT,
+    [OP_DEFINE_GLOBAL_SLOT]       = &&op_OP_DEFINE_GLOBAL_SLOT,
+    [OP_SET_GLOBAL_SLOT]          = &&op_OP_SET_GLOBAL_SLOT,
+    [OP_GET_PROPERTY]             = &&op_UNKNOWN,
+    [OP_SET_PROPERTY]             = &&op_UNKNOWN,
+    [OP_EXPORT_VAR]               = &&op_OP_EXPORT_VAR,
+    [OP_EQUAL]                    = &&op_OP_EQUAL,
+    [OP_GREATER]                  = &&op_OP_GREATER,
+    [OP_LESS]                     = &&op_OP_LESS,
+    [OP_ADD]                      = &&op_OP_ADD,
+    [OP_SUBTRACT]                 = &&op_OP_SUBTRACT,
+    [OP_MULTIPLY]                 = &&op_OP_MULTIPLY,
+    [OP_DIVIDE]                   = &&op_OP_DIVIDE,
+    [OP_MODULO]                   = &&op_OP_MODULO,
+    [OP_NOT]                      = &&op_OP_NOT,
+    [OP_NEGATE]                   = &&op_OP_NEGATE,
+    [OP_PRINT]                    = &&op_OP_PRINT,
+    [OP_JUMP]                     = &&op_OP_JUMP,
+    [OP_JUMP_IF_FALSE]            = &&op_OP_JUMP_IF_FALSE,
+    [OP_LOOP]                     = &&op_OP_LOOP,
+    [OP_CALL]                     = &&op_OP_CALL,
+    [OP_TAIL_CALL]                = &&op_OP_TAIL_CALL,
+    [OP_NEW_LIST]                 = &&op_OP_NEW_LIST,
+    [OP_LIST_APPEND]              = &&op_OP_LIST_APPEND,
+    [OP_GET_SUBSCRIPT]            = &&op_OP_GET_SUBSCRIPT,
+    [OP_SET_SUBSCRIPT]            = &&op_OP_SET_SUBSCRIPT,
+    [OP_IMPORT]                   = &&op_OP_IMPORT,
+    [OP_EXPORT]                   = &&op_OP_EXPORT,
+    [OP_RETURN]                   = &&op_OP_RETURN,
+    [OP_ADD_NUM]                  = &&op_OP_ADD_NUM,
+    [OP_SUBTRACT_NUM]             = &&op_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]             = &&op_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]               = &&op_OP_DIVIDE_NUM,
+    [OP_GREATER_NUM]              = &&op_OP_GREATER_NUM,
+    [OP_LESS_NUM]                 = &&op_OP_LESS_NUM,
+    [OP_GET_SUBSCRIPT_LIST_NUM]   = &&op_OP_GET_SUBSCRIPT_LIST_NUM,
+    [OP_SET_SUBSCRIPT_LIST_NUM]   = &&op_OP_SET_SUBSCRIPT_LIST_NUM,
+    [OP_LESS_LOCALS_JUMP]         = &&op_OP_LESS_LOCALS_JUMP,
+    [OP_LESS_LOCAL_CONSTANT_JUMP] = &&op_OP_LESS_LOCAL_CONSTANT_JUMP,
+    [OP_ADD_LOCALS]               = &&op_OP_ADD_LOCALS,
+    [OP_ADD_LOCAL_CONSTANT]       = &&op_OP_ADD_LOCAL_CONSTANT,
+    [OP_SUBTRACT_LOCAL_CONSTANT]  = &&op_OP_SUBTRACT_LOCAL_CONSTANT,
+    [OP_NOT_EQUAL]                = &&op_OP_NOT_EQUAL,
+    [OP_CONSTANT_CALL]            = &&op_OP_CONSTANT_CALL,
+    [OP_SET_LOCAL_POP]            = &&op_OP_SET_LOCAL_POP,
+    [OP_JUMP_IF_FALSE_OR_POP]     = &&op_OP_JUMP_IF_FALSE_OR_POP,
+  };
+
+#define CASE(op) case op: op_##op
+#define DISPATCH()                                                         \
+  do {                                                                     \
+    TRACE_INSTRUCTION();                                                   \
+    PROFILE_INSTRUCTION();                                                 \
+    goto *dispatchTable[instruction = READ_BYTE()];                        \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+  // With computed goto the switch is only used to enter the first handler.
+  for (;;) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
     switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
+      CASE(OP_CONSTANT): {
         Value constant = READ_CONSTANT();
-        push(constant);
-        break;
+        PUSH(constant);
+        DISPATCH();
       }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
+      CASE(OP_NIL):
+        PUSH(NIL_VAL);
+        DISPATCH();
+      CASE(OP_TRUE):
+        PUSH(BOOL_VAL(true));
+        DISPATCH();
+      CASE(OP_FALSE):
+        PUSH(BOOL_VAL(false));
+        DISPATCH();
+      CASE(OP_POP):
+        sp--;
+        DISPATCH();
+      CASE(OP_GET_LOCAL): {
         uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+        PUSH(slots[slot]);
+        DISPATCH();
       }
-      case OP_SET_LOCAL: {
+      CASE(OP_SET_LOCAL): {
         uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+        slots[slot] = PEEK(0);
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
+      CASE(OP_GET_GLOBAL): {
         ObjString* name = READ_STRING();
         Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        if (!getGlobal(name, &value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
         }
-        push(value);
-        break;
+        PUSH(value);
+        DISPATCH();
       }
-
-
-      case OP_SET_GLOBAL: {
+      CASE(OP_SET_GLOBAL): {
         ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
+        Value value;
+        if (!getGlobal(name, &value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+        }
+        STORE_FRAME();
+        setGlobal(name, PEEK(0));
+        DISPATCH();
+      }
+      CASE(OP_GET_GLOBAL_SLOT): {
+        uint16_t slot = READ_SHORT();
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.",
+                       AS_CSTRING(vm.globalNames.values[slot]));
         }
-        break;
+        PUSH(value);
+        DISPATCH();
+      }
+      CASE(OP_SET_GLOBAL_SLOT): {
+        uint16_t slot = READ_SHORT();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          RUNTIME_ERROR("Undefined variable '%s'.",
+                       AS_CSTRING(vm.globalNames.values[slot]));
+        }
+        vm.globalValues.values[slot] = PEEK(0);
+        DISPATCH();
+      }
+      CASE(OP_DEFINE_GLOBAL_SLOT): {
+        uint16_t slot = READ_SHORT();
+        vm.globalValues.values[slot] = POP();
+        DISPATCH();
       }
-      case OP_EXPORT_VAR: {
+      CASE(OP_EXPORT_VAR): {
         ObjString* name = READ_STRING();
+        ObjModule* module = frame->function->module;
         Value value;
+        STORE_FRAME();
         // Check if the variable is in the globals table first.
-        if (tableGet(&vm.globals, name, &value)) {
-          tableSet(&frame->function->module->variables, name, value);
-        } else {
+        if (!getGlobal(name, &value)) {
           // Fallback to the stack for locally-defined exports.
-          tableSet(&frame->function->module->variables, name, peek(0));
+          value = PEEK(0);
         }
-        break;
+        tableSet(&module->variables, name, value);
+        writeBarrier((Obj*)module, OBJ_VAL(name));
+        writeBarrier((Obj*)module, value);
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL: {
+      CASE(OP_DEFINE_GLOBAL): {
         ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
+        STORE_FRAME();
+        setGlobal(name, PEEK(0));
+        sp--;
+        DISPATCH();
       }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      CASE(OP_EQUAL): {
+        Value b = POP();
+        Value a = POP();
+        PUSH(BOOL_VAL(valuesEqual(a, b)));
+        DISPATCH();
       }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      CASE(OP_GREATER):
+        BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM);
+        DISPATCH();
+      CASE(OP_LESS):
+        BINARY_OP(BOOL_VAL, <, OP_LESS_NUM);
+        DISPATCH();
+      CASE(OP_ADD): {
+        if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+          STORE_FRAME();
           concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+          sp = vm.stackTop;
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+          QUICKEN(OP_ADD_NUM);
+          double b = AS_NUMBER(POP());
+          double a = AS_NUMBER(POP());
+          PUSH(NUMBER_VAL(a + b));
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_MODULO: {
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
-          runtimeError("Operands must be numbers.");
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_SUBTRACT):
+        BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM);
+        DISPATCH();
+      CASE(OP_MULTIPLY):
+        BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM);
+        DISPATCH();
+      CASE(OP_DIVIDE):
+        BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+        DISPATCH();
+      CASE(OP_MODULO): {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          RUNTIME_ERROR("Operands must be numbers.");
         }
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(fmod(a, b)));
-        break;
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(fmod(a, b)));
+        DISPATCH();
       }
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_NOT):
+        PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+        DISPATCH();
+      CASE(OP_NEGATE):
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("Operand must be a number.");
         }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        printValue(pop());
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        DISPATCH();
+      CASE(OP_PRINT): {
+        printValue(POP());
         printf("\n");
-        break;
+        DISPATCH();
       }
-      case OP_JUMP: {
+      CASE(OP_JUMP): {
         uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+        ip += offset;
+        DISPATCH();
       }
-      case OP_JUMP_IF_FALSE: {
+      CASE(OP_JUMP_IF_FALSE): {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+        if (isFalsey(PEEK(0))) ip += offset;
+        DISPATCH();
       }
-      case OP_LOOP: {
+      CASE(OP_LOOP): {
         uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+        ip -= offset;
+#ifdef FLS_JIT
+        STORE_FRAME();  // Compiling allocates, which may collect.
+        jitCountHotness(frame->function);
+#endif
+        ENTER_JIT();
+        DISPATCH();
       }
-      case OP_CALL: {
+      CASE(OP_CALL): {
         int argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
+        STORE_FRAME();
+        if (!callValue(PEEK(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
       }
-      case OP_NEW_LIST: {
+      CASE(OP_TAIL_CALL): {
+        int argCount = READ_BYTE();
+        Value callee = PEEK(argCount);
+        STORE_FRAME();
+        if (IS_FUNCTION(callee)) {
+          if (!tailCall(AS_FUNCTION(callee), argCount,
+                        sp - argCount - 1)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          LOAD_FRAME();
+          ENTER_JIT();
+          DISPATCH();
+        }
+
+        // Natives finish right away, and the OP_RETURN after this returns
+        // their result.
+        if (!callValue(callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+        sp = vm.stackTop;
+        DISPATCH();
+      }
+      CASE(OP_NEW_LIST): {
+        STORE_FRAME();
         ObjList* list = newList();
-        push(OBJ_VAL(list));
-        break;
+        PUSH(OBJ_VAL(list));
+        DISPATCH();
       }
-      case OP_LIST_APPEND: {
-        Value item = pop();
-        ObjList* list = AS_LIST(peek(0));
-        writeValueArray(list->items, item);
-        break;
+      CASE(OP_LIST_APPEND): {
+        // The item stays on the stack while the list grows, which may collect.
+        Value item = PEEK(0);
+        ObjList* list = AS_LIST(PEEK(1));
+        STORE_FRAME();
+        listAppend(list, item);
+        writeBarrier((Obj*)list, item);
+        sp--;
+        DISPATCH();
       }
-      case OP_GET_SUBSCRIPT: {
-        Value indexVal = pop();
-        Value listVal = pop();
+      CASE(OP_GET_SUBSCRIPT): {
+        Value indexVal = POP();
+        Value listVal = POP();
 
         if (!IS_LIST(listVal)) {
-          runtimeError("Can only subscript lists.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Can only subscript lists.");
         }
         ObjList* list = AS_LIST(listVal);
 
         if (!IS_NUMBER(indexVal)) {
-          runtimeError("List index must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index must be a number.");
         }
         int index = AS_NUMBER(indexVal);
 
-        if (index < 0) index = list->items->count + index;
+        if (index < 0) index = list->items.count + index;
 
-        if (index < 0 || index >= list->items->count) {
-          runtimeError("List index out of bounds.");
-          return INTERPRET_RUNTIME_ERROR;
+        if (index < 0 || index >= list->items.count) {
+          RUNTIME_ERROR("List index out of bounds.");
         }
 
-        push(list->items->values[index]);
-        break;
+        QUICKEN(OP_GET_SUBSCRIPT_LIST_NUM);
+        PUSH(list->items.values[index]);
+        DISPATCH();
       }
 
-      case OP_SET_SUBSCRIPT: {
-        Value value = pop();
-        Value indexVal = pop();
-        Value listVal = pop();
+      CASE(OP_SET_SUBSCRIPT): {
+        Value value = POP();
+        Value indexVal = POP();
+        Value listVal = POP();
 
         if (!IS_LIST(listVal)) {
-          runtimeError("Can only subscript lists.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Can only subscript lists.");
         }
         ObjList* list = AS_LIST(listVal);
 
         if (!IS_NUMBER(indexVal)) {
-          runtimeError("List index must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("List index must be a number.");
         }
         int index = AS_NUMBER(indexVal);
 
-        if (index < 0) index = list->items->count + index;
+        if (index < 0) index = list->items.count + index;
 
-        if (index < 0 || index >= list->items->count) {
-          runtimeError("List index out of bounds.");
-          return INTERPRET_RUNTIME_ERROR;
+        if (index < 0 || index >= list->items.count) {
+          RUNTIME_ERROR("List index out of bounds.");
         }
 
-        list->items->values[index] = value;
-        push(value);
-        break;
+        QUICKEN(OP_SET_SUBSCRIPT_LIST_NUM);
+        list->items.values[index] = value;
+        writeBarrier((Obj*)list, value);
+        PUSH(value);
+        DISPATCH();
       }
-      case OP_IMPORT: {
-        ObjString* moduleName = AS_STRING(pop());
-        Value moduleValue;
-
-        if (tableGet(&vm.modules, moduleName, &moduleValue)) {
-          push(moduleValue);
-        } else {
-          if (moduleName == NULL || moduleName->chars == NULL) {
-            runtimeError("Invalid module name.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          char* source = readFile(moduleName->chars);
-          if (source == NULL) {
-            runtimeError("Could not open module '%s'.", moduleName->chars);
-            return INTERPRET_RUNTIME_ERROR;
-          }
-
-          ObjModule* module = newModule(moduleName);
-          push(OBJ_VAL(module));
-
-          tableSet(&vm.modules, moduleName, OBJ_VAL(module));
-
-          ObjFunction* func = compile(source, module);
-          free(source);
+      CASE(OP_ADD_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, +, OP_ADD);
+        DISPATCH();
+      CASE(OP_SUBTRACT_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT);
+        DISPATCH();
+      CASE(OP_MULTIPLY_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY);
+        DISPATCH();
+      CASE(OP_DIVIDE_NUM):
+        QUICK_BINARY_OP(NUMBER_VAL, /, OP_DIVIDE);
+        DISPATCH();
+      CASE(OP_GREATER_NUM):
+        QUICK_BINARY_OP(BOOL_VAL, >, OP_GREATER);
+        DISPATCH();
+      CASE(OP_LESS_NUM):
+        QUICK_BINARY_OP(BOOL_VAL, <, OP_LESS);
+        DISPATCH();
+      CASE(OP_GET_SUBSCRIPT_LIST_NUM): {
+        Value indexVal = PEEK(0);
+        Value listVal = PEEK(1);
+        if (!IS_LIST(listVal) || !IS_NUMBER(indexVal)) {
+          DEOPTIMIZE(OP_GET_SUBSCRIPT);
+          DISPATCH();
+        }
 
-          if (func == NULL) {
-            tableDelete(&vm.modules, moduleName);
-            pop(); // Pop the module.
-            return INTERPRET_COMPILE_ERROR;
-          }
+        ValueArray* items = &AS_LIST(listVal)->items;
+        int index = AS_NUMBER(indexVal);
+        if (index < 0) index = items->count + index;
+        if (index < 0 || index >= items->count) {
+          RUNTIME_ERROR("List index out of bounds.");
+        }
 
-          // The module is on the stack. We pop it, push the function, and call it.
-          pop(); // Pop the module.
-          push(OBJ_VAL(func));
-          call(func, 0);
-          frame = &vm.frames[vm.frameCount - 1];
+        sp--;
+        sp[-1] = items->values[index];
+        DISPATCH();
+      }
+      CASE(OP_SET_SUBSCRIPT_LIST_NUM): {
+        Value indexVal = PEEK(1);
+        Value listVal = PEEK(2);
+        if (!IS_LIST(listVal) || !IS_NUMBER(indexVal)) {
+          DEOPTIMIZE(OP_SET_SUBSCRIPT);
+          DISPATCH();
+        }
 
-          // The module has been executed. Now, copy its exported variables
-          // to the global scope.
-          for (int i = 0; i < module->variables.capacity; i++) {
-            Entry* entry = &module->variables.entries[i];
-            if (entry->key != NULL) {
-              tableSet(&vm.globals, entry->key, entry->value);
-            }
-          }
+        ValueArray* items = &AS_LIST(listVal)->items;
+        int index = AS_NUMBER(indexVal);
+        if (index < 0) index = items->count + index;
+        if (index < 0 || index >= items->count) {
+          RUNTIME_ERROR("List index out of bounds.");
+        }
 
-          // The import statement leaves the module object on the stack.
-          vm.stackTop[-1] = OBJ_VAL(module);
+        Value value = PEEK(0);
+        items->values[index] = value;
+        writeBarrier(AS_OBJ(listVal), value);
+        sp -= 2;
+        sp[-1] = value;
+        DISPATCH();
+      }
+      CASE(OP_LESS_LOCALS_JUMP): {
+        Value a = slots[READ_BYTE()];
+        Value b = slots[READ_BYTE()];
+        FUSED_LESS_JUMP(a, b);
+        DISPATCH();
+      }
+      CASE(OP_LESS_LOCAL_CONSTANT_JUMP): {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        FUSED_LESS_JUMP(a, b);
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCALS): {
+        Value a = slots[READ_BYTE()];
+        Value b = slots[READ_BYTE()];
+        FUSED_ADD(a, b);
+        DISPATCH();
+      }
+      CASE(OP_ADD_LOCAL_CONSTANT): {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        FUSED_ADD(a, b);
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+        Value a = slots[READ_BYTE()];
+        Value b = READ_CONSTANT();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          RUNTIME_ERROR("Operands must be numbers.");
         }
-        break;
+        PUSH(NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+        DISPATCH();
+      }
+      CASE(OP_NOT_EQUAL): {
+        Value b = POP();
+        sp[-1] = BOOL_VAL(!valuesEqual(sp[-1], b));
+        DISPATCH();
       }
-      case OP_EXPORT: {
+      CASE(OP_CONSTANT_CALL): {
+        PUSH(READ_CONSTANT());
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        if (!callValue(PEEK(argCount), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL_POP): {
+        uint8_t slot = READ_BYTE();
+        slots[slot] = POP();
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_FALSE_OR_POP): {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(PEEK(0))) {
+          ip += offset;
+        } else {
+          sp--;
+        }
+        DISPATCH();
+      }
+      CASE(OP_IMPORT): {
+        STORE_FRAME();
+        InterpretResult result = importModule();
+        if (result != INTERPRET_OK) return result;
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_EXPORT): {
         ObjString* varName = READ_STRING();
         ObjModule* module = frame->function->module;
         if (module == NULL) {
-          runtimeError("Cannot export from top-level script.");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Cannot export from top-level script.");
         }
-        tableSet(&module->variables, varName, peek(0));
+        STORE_FRAME();
+        tableSet(&module->variables, varName, PEEK(0));
+        writeBarrier((Obj*)module, OBJ_VAL(varName));
+        writeBarrier((Obj*)module, PEEK(0));
         // Unlike OP_DEFINE_GLOBAL, we keep the value on the stack
         // for the export statement to use.
-        break;
+        DISPATCH();
       }
-      case OP_RETURN: {
-        Value result = pop();
+      CASE(OP_RETURN): {
+        Value result = POP();
         vm.frameCount--;
 
         if (vm.frameCount == 0) {
-          pop(); // Pop main script function.
+          sp--; // Pop main script function.
+          vm.stackTop = sp;
           return INTERPRET_OK;
         }
 
-        vm.stackTop = frame->slots;
-        push(result);
-
-        // After returning, the current frame is the one we are returning to.
-        // We need to update our local 'frame' variable to point to it.
+        // The result replaces the callee and its arguments, which start at
+        // the returning frame's first slot.
+        sp = slots;
+        PUSH(result);
         frame = &vm.frames[vm.frameCount - 1];
-        break;
+        ip = frame->ip;
+        slots = frame->slots;
+        ENTER_JIT();
+        DISPATCH();
       }
+      default:
+#ifdef FLS_COMPUTED_GOTO
+      op_UNKNOWN:
+#endif
+        RUNTIME_ERROR("Unknown opcode %d.", instruction);
     }
   }
 
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef QUICK_BINARY_OP
+#undef FUSED_ADD
+#undef FUSED_LESS_JUMP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef ENTER_JIT
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* path, const char* source) {
-  ObjModule* mainModule = newModule(copyString(path, path == NULL ? 0 : strlen(path)));
+// Sets up the register file of the frame call() just pushed: registers past
+// the arguments start out nil, and vm.stackTop sits above the last register
+// so natives and string concatenation push into free space.
+static bool enterRegisterFrame() {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  Value* top = frame->slots + frame->function->registerCount;
+  if (top > vm.stack + STACK_MAX) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+
+  for (Value* slot = vm.stackTop; slot < top; slot++) {
+    *slot = NIL_VAL;
+  }
+  vm.stackTop = top;
+  return true;
+}
+
+// The interpreter loop for code compiled by the register backend. Frames,
+// calls and natives work as in run(); only the instruction set differs.
+static InterpretResult runRegisters() {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  if (!enterRegisterFrame()) return INTERPRET_RUNTIME_ERROR;
+
+#define READ_BYTE() (*frame->ip++)
+#define READ_SHORT() \
+  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_REGISTER() (frame->slots[READ_BYTE()])
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+
+// Restores vm.stackTop above the current frame's registers. Registers that
+// were above the stack top during a call were not roots, so the collector may
+// have freed what they held; they are dead, and are cleared before the stack
+// top covers them again.
+#define RESET_STACK_TOP()                                              \
+  do {                                                                 \
+    Value* top = frame->slots + frame->function->registerCount;        \
+    while (vm.stackTop < top) *vm.stackTop++ = NIL_VAL;                \
+    vm.stackTop = top;                                                 \
+  } while (false)
+
+#define REGISTER_BINARY_OP(valueType, op, readRight)                       \
+  do {                                                                     \
+    uint8_t dest = READ_BYTE();                                            \
+    Value b = READ_REGISTER();                                             \
+    Value c = readRight();                                                 \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                                  \
+      runtimeError("Operands must be numbers.");                           \
+      return INTERPRET_RUNTIME_ERROR;                                      \
+    }                                                                      \
+    frame->slots[dest] = valueType(AS_NUMBER(b) op AS_NUMBER(c));          \
+  } while (false)
+
+#define REGISTER_ADD(readRight)                                            \
+  do {                                                                     \
+    uint8_t dest = READ_BYTE();                                            \
+    Value b = READ_REGISTER();                                             \
+    Value c = readRight();                                                 \
+    if (IS_NUMBER(b) && IS_NUMBER(c)) {                                    \
+      frame->slots[dest] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));        \
+    } else if (IS_STRING(b) && IS_STRING(c)) {                             \
+      push(b);                                                             \
+      push(c);                                                             \
+      concatenate();                                                       \
+      frame->slots[dest] = pop();                                          \
+    } else {                                                               \
+      runtimeError("Operands must be two numbers or two strings.");        \
+      return INTERPRET_RUNTIME_ERROR;                                      \
+    }                                                                      \
+  } while (false)
+
+#define REGISTER_MODULO(readRight)                                         \
+  do {                                                                     \
+    uint8_t dest = READ_BYTE();                                            \
+    Value b = READ_REGISTER();                                             \
+    Value c = readRight();                                                 \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                                  \
+      runtimeError("Operands must be numbers.");                           \
+      return INTERPRET_RUNTIME_ERROR;                                      \
+    }                                                                      \
+    frame->slots[dest] = NUMBER_VAL(fmod(AS_NUMBER(b), AS_NUMBER(c)));     \
+  } while (false)
+
+#define REGISTER_EQUAL(readRight)                                          \
+  do {                                                                     \
+    uint8_t dest = READ_BYTE();                                            \
+    Value b = READ_REGISTER();                                             \
+    Value c = readRight();                                                 \
+    frame->slots[dest] = BOOL_VAL(valuesEqual(b, c));                      \
+  } while (false)
+
+#define REGISTER_JUMP_IF_NOT_LESS(readRight)                               \
+  do {                                                                     \
+    Value b = READ_REGISTER();                                             \
+    Value c = readRight();                                                 \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                                  \
+      runtimeError("Operands must be numbers.");                           \
+      return INTERPRET_RUNTIME_ERROR;                                      \
+    }                                                                      \
+    uint16_t offset = READ_SHORT();                                        \
+    if (!(AS_NUMBER(b) < AS_NUMBER(c))) frame->ip += offset;               \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION()                                                \
+  do {                                                                     \
+    printf("          ");                                                  \
+    for (Value* slot = frame->slots;                                       \
+         slot < frame->slots + frame->function->registerCount; slot++) {   \
+      printf("[ ");                                                        \
+      printValue(*slot);                                                   \
+      printf(" ]");                                                        \
+    }                                                                      \
+    printf("\n");                                                          \
+    disassembleRegisterInstruction(&frame->function->chunk,                \
+        (int)(frame->ip - frame->function->chunk.code));                   \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+  uint8_t instruction;
+
+#ifdef FLS_COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    [ROP_MOVE]              = &&op_ROP_MOVE,
+    [ROP_LOADK]             = &&op_ROP_LOADK,
+    [ROP_LOADNIL]           = &&op_ROP_LOADNIL,
+    [ROP_LOADTRUE]          = &&op_ROP_LOADTRUE,
+    [ROP_LOADFALSE]         = &&op_ROP_LOADFALSE,
+    [ROP_GET_GLOBAL]        = &&op_ROP_GET_GLOBAL,
+    [ROP_SET_GLOBAL]        = &&op_ROP_SET_GLOBAL,
+    [ROP_DEFINE_GLOBAL]     = &&op_ROP_DEFINE_GLOBAL,
+    [ROP_ADD]               = &&op_ROP_ADD,
+    [ROP_ADDK]              = &&op_ROP_ADDK,
+    [ROP_SUBTRACT]          = &&op_ROP_SUBTRACT,
+    [ROP_SUBTRACTK]         = &&op_ROP_SUBTRACTK,
+    [ROP_MULTIPLY]          = &&op_ROP_MULTIPLY,
+    [ROP_MULTIPLYK]         = &&op_ROP_MULTIPLYK,
+    [ROP_DIVIDE]            = &&op_ROP_DIVIDE,
+    [ROP_DIVIDEK]           = &&op_ROP_DIVIDEK,
+    [ROP_MODULO]            = &&op_ROP_MODULO,
+    [ROP_MODULOK]           = &&op_ROP_MODULOK,
+    [ROP_EQUAL]             = &&op_ROP_EQUAL,
+    [ROP_EQUALK]            = &&op_ROP_EQUALK,
+    [ROP_LESS]              = &&op_ROP_LESS,
+    [ROP_LESSK]             = &&op_ROP_LESSK,
+    [ROP_GREATER]           = &&op_ROP_GREATER,
+    [ROP_GREATERK]          = &&op_ROP_GREATERK,
+    [ROP_NOT]               = &&op_ROP_NOT,
+    [ROP_NEGATE]            = &&op_ROP_NEGATE,
+    [ROP_JUMP]              = &&op_ROP_JUMP,
+    [ROP_JUMP_IF_FALSE]     = &&op_ROP_JUMP_IF_FALSE,
+    [ROP_JUMP_IF_NOT_LESS]  = &&op_ROP_JUMP_IF_NOT_LESS,
+    [ROP_JUMP_IF_NOT_LESSK] = &&op_ROP_JUMP_IF_NOT_LESSK,
+    [ROP_LOOP]              = &&op_ROP_LOOP,
+    [ROP_CALL]              = &&op_ROP_CALL,
+    [ROP_TAIL_CALL]         = &&op_ROP_TAIL_CALL,
+    [ROP_RETURN]            = &&op_ROP_RETURN,
+    [ROP_NEW_LIST]          = &&op_ROP_NEW_LIST,
+    [ROP_LIST_APPEND]       = &&op_ROP_LIST_APPEND,
+    [ROP_GET_SUBSCRIPT]     = &&op_ROP_GET_SUBSCRIPT,
+    [ROP_SET_SUBSCRIPT]     = &&op_ROP_SET_SUBSCRIPT,
+    [ROP_IMPORT]            = &&op_ROP_IMPORT,
+    [ROP_EXPORT]            = &&op_ROP_EXPORT,
+  };
+
+#define CASE(op) case op: op_##op
+#define DISPATCH()                                                         \
+  do {                                                                     \
+    TRACE_INSTRUCTION();                                                   \
+    goto *dispatchTable[instruction = READ_BYTE()];                        \
+  } while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+
+  for (;;) {
+    TRACE_INSTRUCTION();
+    switch (instruction = READ_BYTE()) {
+      CASE(ROP_MOVE): {
+        uint8_t dest = READ_BYTE();
+        frame->slots[dest] = READ_REGISTER();
+        DISPATCH();
+      }
+      CASE(ROP_LOADK): {
+        uint8_t dest = READ_BYTE();
+        frame->slots[dest] = READ_CONSTANT();
+        DISPATCH();
+      }
+      CASE(ROP_LOADNIL):
+        frame->slots[READ_BYTE()] = NIL_VAL;
+        DISPATCH();
+      CASE(ROP_LOADTRUE):
+        frame->slots[READ_BYTE()] = BOOL_VAL(true);
+        DISPATCH();
+      CASE(ROP_LOADFALSE):
+        frame->slots[READ_BYTE()] = BOOL_VAL(false);
+        DISPATCH();
+      CASE(ROP_GET_GLOBAL): {
+        uint8_t dest = READ_BYTE();
+        uint16_t slot = READ_SHORT();
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+          runtimeError("Undefined variable '%s'.",
+                       AS_CSTRING(vm.globalNames.values[slot]));
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame->slots[dest] = value;
+        DISPATCH();
+      }
+      CASE(ROP_SET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        Value value = READ_REGISTER();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          runtimeError("Undefined variable '%s'.",
+                       AS_CSTRING(vm.globalNames.values[slot]));
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        vm.globalValues.values[slot] = value;
+        DISPATCH();
+      }
+      CASE(ROP_DEFINE_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        vm.globalValues.values[slot] = READ_REGISTER();
+        DISPATCH();
+      }
+      CASE(ROP_ADD):
+        REGISTER_ADD(READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_ADDK):
+        REGISTER_ADD(READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_SUBTRACT):
+        REGISTER_BINARY_OP(NUMBER_VAL, -, READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_SUBTRACTK):
+        REGISTER_BINARY_OP(NUMBER_VAL, -, READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_MULTIPLY):
+        REGISTER_BINARY_OP(NUMBER_VAL, *, READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_MULTIPLYK):
+        REGISTER_BINARY_OP(NUMBER_VAL, *, READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_DIVIDE):
+        REGISTER_BINARY_OP(NUMBER_VAL, /, READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_DIVIDEK):
+        REGISTER_BINARY_OP(NUMBER_VAL, /, READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_MODULO):
+        REGISTER_MODULO(READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_MODULOK):
+        REGISTER_MODULO(READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_EQUAL):
+        REGISTER_EQUAL(READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_EQUALK):
+        REGISTER_EQUAL(READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_LESS):
+        REGISTER_BINARY_OP(BOOL_VAL, <, READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_LESSK):
+        REGISTER_BINARY_OP(BOOL_VAL, <, READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_GREATER):
+        REGISTER_BINARY_OP(BOOL_VAL, >, READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_GREATERK):
+        REGISTER_BINARY_OP(BOOL_VAL, >, READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_NOT): {
+        uint8_t dest = READ_BYTE();
+        frame->slots[dest] = BOOL_VAL(isFalsey(READ_REGISTER()));
+        DISPATCH();
+      }
+      CASE(ROP_NEGATE): {
+        uint8_t dest = READ_BYTE();
+        Value value = READ_REGISTER();
+        if (!IS_NUMBER(value)) {
+          runtimeError("Operand must be a number.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame->slots[dest] = NUMBER_VAL(-AS_NUMBER(value));
+        DISPATCH();
+      }
+      CASE(ROP_JUMP): {
+        uint16_t offset = READ_SHORT();
+        frame->ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_JUMP_IF_FALSE): {
+        Value condition = READ_REGISTER();
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(condition)) frame->ip += offset;
+        DISPATCH();
+      }
+      CASE(ROP_JUMP_IF_NOT_LESS):
+        REGISTER_JUMP_IF_NOT_LESS(READ_REGISTER);
+        DISPATCH();
+      CASE(ROP_JUMP_IF_NOT_LESSK):
+        REGISTER_JUMP_IF_NOT_LESS(READ_CONSTANT);
+        DISPATCH();
+      CASE(ROP_LOOP): {
+        uint16_t offset = READ_SHORT();
+        frame->ip -= offset;
+        DISPATCH();
+      }
+      CASE(ROP_CALL): {
+        uint8_t callee = READ_BYTE();
+        int argCount = READ_BYTE();
+        int frameCount = vm.frameCount;
+
+        // call() and the natives find the arguments below vm.stackTop.
+        vm.stackTop = &frame->slots[callee + argCount + 1];
+        if (!callValue(frame->slots[callee], argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        if (vm.frameCount != frameCount) {
+          if (!enterRegisterFrame()) return INTERPRET_RUNTIME_ERROR;
+          frame = &vm.frames[vm.frameCount - 1];
+        } else {
+          RESET_STACK_TOP();
+        }
+        DISPATCH();
+      }
+      CASE(ROP_TAIL_CALL): {
+        uint8_t callee = READ_BYTE();
+        int argCount = READ_BYTE();
+        Value* args = &frame->slots[callee];
+        if (IS_FUNCTION(*args)) {
+          if (!tailCall(AS_FUNCTION(*args), argCount, args) ||
+              !enterRegisterFrame()) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          DISPATCH();
+        }
+
+        // As in run(), natives return through the ROP_RETURN that follows.
+        vm.stackTop = &frame->slots[callee + argCount + 1];
+        if (!callValue(*args, argCount)) return INTERPRET_RUNTIME_ERROR;
+        RESET_STACK_TOP();
+        DISPATCH();
+      }
+      CASE(ROP_RETURN): {
+        Value result = READ_REGISTER();
+        vm.frameCount--;
+
+        if (vm.frameCount == 0) {
+          vm.stackTop = frame->slots;
+          return INTERPRET_OK;
+        }
+
+        // The callee's first slot is the caller register that held it.
+        frame->slots[0] = result;
+        frame = &vm.frames[vm.frameCount - 1];
+        RESET_STACK_TOP();
+        DISPATCH();
+      }
+      CASE(ROP_NEW_LIST): {
+        uint8_t dest = READ_BYTE();
+        frame->slots[dest] = OBJ_VAL(newList());
+        DISPATCH();
+      }
+      CASE(ROP_LIST_APPEND): {
+        ObjList* list = AS_LIST(READ_REGISTER());
+        Value item = READ_REGISTER();
+        listAppend(list, item);
+        writeBarrier((Obj*)list, item);
+        DISPATCH();
+      }
+      CASE(ROP_GET_SUBSCRIPT): {
+        uint8_t dest = READ_BYTE();
+        Value listVal = READ_REGISTER();
+        Value indexVal = READ_REGISTER();
+
+        if (!IS_LIST(listVal)) {
+          runtimeError("Can only subscript lists.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (!IS_NUMBER(indexVal)) {
+          runtimeError("List index must be a number.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        ValueArray* items = &AS_LIST(listVal)->items;
+        int index = AS_NUMBER(indexVal);
+        if (index < 0) index = items->count + index;
+        if (index < 0 || index >= items->count) {
+          runtimeError("List index out of bounds.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        frame->slots[dest] = items->values[index];
+        DISPATCH();
+      }
+      CASE(ROP_SET_SUBSCRIPT): {
+        uint8_t dest = READ_BYTE();
+        Value listVal = READ_REGISTER();
+        Value indexVal = READ_REGISTER();
+        Value value = READ_REGISTER();
+
+        if (!IS_LIST(listVal)) {
+          runtimeError("Can only subscript lists.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (!IS_NUMBER(indexVal)) {
+          runtimeError("List index must be a number.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        ValueArray* items = &AS_LIST(listVal)->items;
+        int index = AS_NUMBER(indexVal);
+        if (index < 0) index = items->count + index;
+        if (index < 0 || index >= items->count) {
+          runtimeError("List index out of bounds.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        items->values[index] = value;
+        writeBarrier(AS_OBJ(listVal), value);
+        frame->slots[dest] = value;
+        DISPATCH();
+      }
+      CASE(ROP_IMPORT): {
+        uint8_t reg = READ_BYTE();
+        int frameCount = vm.frameCount;
+
+        vm.stackTop = &frame->slots[reg + 1];
+        InterpretResult result = importModule();
+        if (result != INTERPRET_OK) return result;
+
+        if (vm.frameCount != frameCount) {
+          if (!enterRegisterFrame()) return INTERPRET_RUNTIME_ERROR;
+          frame = &vm.frames[vm.frameCount - 1];
+        } else {
+          RESET_STACK_TOP();
+        }
+        DISPATCH();
+      }
+      CASE(ROP_EXPORT): {
+        Value value = READ_REGISTER();
+        ObjString* varName = READ_STRING();
+        ObjModule* module = frame->function->module;
+        if (module == NULL) {
+          runtimeError("Cannot export from top-level script.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        tableSet(&module->variables, varName, value);
+        writeBarrier((Obj*)module, OBJ_VAL(varName));
+        writeBarrier((Obj*)module, value);
+        DISPATCH();
+      }
+      default:
+        runtimeError("Unknown opcode %d.", instruction);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+  }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_REGISTER
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef RESET_STACK_TOP
+#undef REGISTER_BINARY_OP
+#undef REGISTER_ADD
+#undef REGISTER_MODULO
+#undef REGISTER_EQUAL
+#undef REGISTER_JUMP_IF_NOT_LESS
+#undef TRACE_INSTRUCTION
+#undef CASE
+#undef DISPATCH
+}
+
+void heapLimitError() {
+  char message[80];
+  if (vm.hardLimit != 0) {
+    snprintf(message, sizeof(message),
+             "Out of memory: the heap limit of %zu bytes was reached.",
+             vm.hardLimit);
+  } else {
+    snprintf(message, sizeof(message), "Out of memory.");
+  }
+  if (isCompiling()) {
+    compilingError(message);
+    resetStack();
+  } else if (vm.frameCount > 0) {
+    runtimeError("%s", message);
+  } else {
+    fprintf(stderr, "Runtime Error: %s\n", message);
+    resetStack();
+  }
+  if (vm.errorJump != NULL) longjmp(*vm.errorJump, 1);
+  exit(70);
+}
+
+static InterpretResult interpretModule(const char* path, const char* source) {
+  push(OBJ_VAL(copyString(path, path == NULL ? 0 : strlen(path))));
+  ObjModule* mainModule = newModule(AS_STRING(peek(0)));
+  vm.stackTop[-1] = OBJ_VAL(mainModule);
 
   ObjFunction* function = compile(source, mainModule);
+  pop();
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
   push(OBJ_VAL(function));
   call(function, 0);
 
-  return run();
+  return vm.backend == BACKEND_REGISTER ? runRegisters() : run();
+}
+
+InterpretResult interpret(const char* path, const char* source) {
+  // Hitting the heap limit unwinds straight back to here, from wherever
+  // the allocation happened.
+  jmp_buf errorJump;
+  if (setjmp(errorJump) != 0) {
+    vm.errorJump = NULL;
+    abandonCompilation();
+    // Leave the next script, or the next line of the REPL, all the room
+    // the failed one no longer holds.
+    collectGarbage();
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
+  vm.errorJump = &errorJump;
+  vm.hadError = false;
+  InterpretResult result = interpretModule(path, source);
+  vm.errorJump = NULL;
+  return result;
 }
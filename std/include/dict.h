@@ -8,5 +8,11 @@ Value dictSetNative(int argCount, Value* args);
 Value dictGetNative(int argCount, Value* args);
 Value dictDeleteNative(int argCount, Value* args);
 Value dictExistsNative(int argCount, Value* args);
+Value dictKeysNative(int argCount, Value* args);
+Value dictValuesNative(int argCount, Value* args);
+Value dictEntriesNative(int argCount, Value* args);
+Value dictNextNative(int argCount, Value* args);
+Value dictKeyAtNative(int argCount, Value* args);
+Value dictValueAtNative(int argCount, Value* args);
 
 #endif // FLS_DICT_H
@@ -17,26 +17,28 @@ Value newDictNative(int argCount, Value* args) {
 
 // Sets a key-value pair in a dictionary.
 Value dictSetNative(int argCount, Value* args) {
-    if (argCount != 3 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictSet() expects a dictionary, a string key, and a value.");
+    Value key = argCount == 3 ? tableKey(args[1]) : UNDEFINED_VAL;
+    if (argCount != 3 || !IS_MAP(args[0]) || IS_UNDEFINED(key)) {
+        runtimeError("dictSet() expects a dictionary, a key (nil, a bool, a number or a string), and a value.");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
-    tableSet(&map->table, key, args[2]);
+    tableSetValue(&map->table, key, args[2]);
+    writeBarrier((Obj*)map, key);
+    writeBarrier((Obj*)map, args[2]);
     return NIL_VAL; // Or maybe return the value?
 }
 
 // Gets a value from a dictionary.
 Value dictGetNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictGet() expects a dictionary and a string key.");
+    Value key = argCount == 2 ? tableKey(args[1]) : UNDEFINED_VAL;
+    if (argCount != 2 || !IS_MAP(args[0]) || IS_UNDEFINED(key)) {
+        runtimeError("dictGet() expects a dictionary and a key (nil, a bool, a number or a string).");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
     Value value;
-    if (tableGet(&map->table, key, &value)) {
+    if (tableGetValue(&map->table, key, &value)) {
         return value;
     }
     return NIL_VAL; // Key not found
@@ -44,23 +46,128 @@ Value dictGetNative(int argCount, Value* args) {
 
 // Deletes a key-value pair from a dictionary.
 Value dictDeleteNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictDelete() expects a dictionary and a string key.");
+    Value key = argCount == 2 ? tableKey(args[1]) : UNDEFINED_VAL;
+    if (argCount != 2 || !IS_MAP(args[0]) || IS_UNDEFINED(key)) {
+        runtimeError("dictDelete() expects a dictionary and a key (nil, a bool, a number or a string).");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
-    return BOOL_VAL(tableDelete(&map->table, key));
+    return BOOL_VAL(tableDeleteValue(&map->table, key));
 }
 
 // Checks if a key exists in a dictionary.
 Value dictExistsNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_MAP(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("dictExists() expects a dictionary and a string key.");
+    Value key = argCount == 2 ? tableKey(args[1]) : UNDEFINED_VAL;
+    if (argCount != 2 || !IS_MAP(args[0]) || IS_UNDEFINED(key)) {
+        runtimeError("dictExists() expects a dictionary and a key (nil, a bool, a number or a string).");
         return NIL_VAL;
     }
     ObjMap* map = AS_MAP(args[0]);
-    ObjString* key = AS_STRING(args[1]);
     Value value;
-    return BOOL_VAL(tableGet(&map->table, key, &value));
+    return BOOL_VAL(tableGetValue(&map->table, key, &value));
+}
+
+// Collects a dictionary's keys, values or [key, value] pairs into a new
+// list, in the order the keys were first set.
+typedef enum {
+    DICT_KEYS,
+    DICT_VALUES,
+    DICT_ENTRIES,
+} DictPart;
+
+static Value dictList(const char* name, DictPart part, int argCount, Value* args) {
+    if (argCount != 1 || !IS_MAP(args[0])) {
+        runtimeError("%s() expects a dictionary.", name);
+        return NIL_VAL;
+    }
+    Table* table = &AS_MAP(args[0])->table;
+    ObjList* list = newList();
+    push(OBJ_VAL(list));
+    // Nothing here can change the table, so the entries stay put while the
+    // lists grow.
+    for (int i = 0; i < table->entryCount; i++) {
+        Entry* entry = &table->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+
+        // Growing a list may collect and promote it, so each append needs
+        // the barrier.
+        if (part == DICT_KEYS) {
+            listAppend(list, entry->key);
+            writeBarrier((Obj*)list, entry->key);
+        } else if (part == DICT_VALUES) {
+            listAppend(list, entry->value);
+            writeBarrier((Obj*)list, entry->value);
+        } else {
+            ObjList* pair = newList();
+            push(OBJ_VAL(pair));
+            listAppend(pair, entry->key);
+            writeBarrier((Obj*)pair, entry->key);
+            listAppend(pair, entry->value);
+            writeBarrier((Obj*)pair, entry->value);
+            listAppend(list, OBJ_VAL(pair));
+            writeBarrier((Obj*)list, OBJ_VAL(pair));
+            pop();
+        }
+    }
+    pop();
+    return OBJ_VAL(list);
+}
+
+Value dictKeysNative(int argCount, Value* args) {
+    return dictList("dictKeys", DICT_KEYS, argCount, args);
+}
+
+Value dictValuesNative(int argCount, Value* args) {
+    return dictList("dictValues", DICT_VALUES, argCount, args);
+}
+
+Value dictEntriesNative(int argCount, Value* args) {
+    return dictList("dictEntries", DICT_ENTRIES, argCount, args);
+}
+
+// Steps through a dictionary without allocating. dictNext(dict, nil)
+// returns the position of the first entry, dictNext(dict, position) the one
+// after it, and nil once there are no more. Setting a new key or deleting
+// one while iterating can move the entries and invalidate the position.
+Value dictNextNative(int argCount, Value* args) {
+    if (argCount != 2 || !IS_MAP(args[0]) ||
+        (!IS_NIL(args[1]) && !IS_NUMBER(args[1]))) {
+        runtimeError("dictNext() expects a dictionary and a position or nil.");
+        return NIL_VAL;
+    }
+    Table* table = &AS_MAP(args[0])->table;
+    int position = IS_NIL(args[1]) ? 0 : (int)AS_NUMBER(args[1]) + 1;
+    if (position < 0) position = 0;
+    for (; position < table->entryCount; position++) {
+        if (!IS_UNDEFINED(table->entries[position].key)) {
+            return NUMBER_VAL(position);
+        }
+    }
+    return NIL_VAL;
+}
+
+// Returns the entry at a position dictNext() returned.
+static Entry* dictEntryAt(const char* name, int argCount, Value* args) {
+    if (argCount != 2 || !IS_MAP(args[0]) || !IS_NUMBER(args[1])) {
+        runtimeError("%s() expects a dictionary and a position.", name);
+        return NULL;
+    }
+    Table* table = &AS_MAP(args[0])->table;
+    double position = AS_NUMBER(args[1]);
+    if (!(position >= 0 && position < table->entryCount) ||
+        IS_UNDEFINED(table->entries[(int)position].key)) {
+        runtimeError("%s() position is not an entry of the dictionary.", name);
+        return NULL;
+    }
+    return &table->entries[(int)position];
+}
+
+Value dictKeyAtNative(int argCount, Value* args) {
+    Entry* entry = dictEntryAt("dictKeyAt", argCount, args);
+    return entry == NULL ? NIL_VAL : entry->key;
+}
+
+Value dictValueAtNative(int argCount, Value* args) {
+    Entry* entry = dictEntryAt("dictValueAt", argCount, args);
+    return entry == NULL ? NIL_VAL : entry->value;
 }
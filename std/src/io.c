@@ -8,6 +8,7 @@
 
 #include "io.h"
 #include "value.h"
+#include "memory.h"
 #include "object.h" // For string objects
 #include "vm.h"     // For runtimeError
 #include <ctype.h>
@@ -89,35 +90,31 @@ Value readFileNative(int argCount, Value* args) {
     }
 
     const char* path = AS_CSTRING(args[0]);
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
         return NIL_VAL; // Return nil if file can't be opened
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+    // Read straight into the string. It is reserved before the file is
+    // opened, so a file too big for the heap fails with nothing to clean up.
+    size_t fileSize = (size_t)info.st_size;
+    ObjString* contents = reserveString((int)fileSize);
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        fclose(file);
-        exit(74);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        discardString(contents);
+        return NIL_VAL;
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    size_t bytesRead = fread(contents->chars, sizeof(char), fileSize, file);
     if (bytesRead < fileSize) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
-        free(buffer);
         fclose(file);
         exit(74);
     }
-
-    buffer[bytesRead] = '\0';
     fclose(file);
 
-    // takeString will handle freeing the buffer
-    return OBJ_VAL(takeString(buffer, bytesRead));
+    return OBJ_VAL(takeString(contents));
 }
 
 Value writeFileNative(int argCount, Value* args) {
@@ -296,7 +293,8 @@ Value splitNative(int argCount, Value* args) {
 
     if (delim_len == 0) { // Handle empty delimiter
         // Just return the original string in a list
-        writeValueArray(list->items, OBJ_VAL(copyString(source, str->length)));
+        listAppend(list, OBJ_VAL(str));
+        writeBarrier((Obj*)list, OBJ_VAL(str));
         pop();
         return OBJ_VAL(list);
     }
@@ -307,14 +305,21 @@ Value splitNative(int argCount, Value* args) {
     while (found != NULL) {
         int token_len = found - current;
         Value tokenValue = OBJ_VAL(copyString(current, token_len));
-        writeValueArray(list->items, tokenValue);
+        push(tokenValue); // Growing the list may collect.
+        listAppend(list, tokenValue);
+        writeBarrier((Obj*)list, tokenValue);
+        pop();
 
         current = found + delim_len;
         found = strstr(current, delim);
     }
 
     // Add the final part of the string after the last delimiter
-    writeValueArray(list->items, OBJ_VAL(copyString(current, strlen(current))));
+    Value lastValue = OBJ_VAL(copyString(current, strlen(current)));
+    push(lastValue);
+    listAppend(list, lastValue);
+    writeBarrier((Obj*)list, lastValue);
+    pop();
 
     pop();
     return OBJ_VAL(list);